@@ -0,0 +1,717 @@
+// kernel/bench.c
+// 启动时运行的简单性能测试，用 rdcycle 计数（周期数会受 QEMU 影响，只看相对值）。
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+#include "kmem.h"
+#include "vm.h"
+#include "swap.h"
+#include "trapstat.h"
+#include "timer.h"
+#include "wheel.h"
+#include "softirq.h"
+#include <string.h>
+
+#define MB (1024UL * 1024)
+#define BENCH_PAGES (MB / PGSIZE)   // 每轮测试 1 MiB
+#define BENCH_VM_MB 4
+
+static void *bench_pages[BENCH_PAGES];
+
+// 逐页 kalloc/kfree 与 kalloc_batch/kfree_batch 的对比，
+// 以及 uvmalloc/freevm（批量路径）与逐页 kalloc+mappages 的对比。
+void bench_kalloc_batch(void) {
+  printf("bench: kalloc batch vs per-page\n");
+
+  // --- 纯分配器：1 MiB ---
+  uint64 t0 = r_cycle();
+  int n = 0;
+  for(; n < BENCH_PAGES; n++){
+    if((bench_pages[n] = kalloc()) == 0)
+      break;
+  }
+  for(int i = 0; i < n; i++)
+    kfree(bench_pages[i]);
+  uint64 single = r_cycle() - t0;
+
+  t0 = r_cycle();
+  int m = kalloc_batch(BENCH_PAGES, bench_pages);
+  kfree_batch(bench_pages, m);
+  uint64 batch = r_cycle() - t0;
+
+  if(n < BENCH_PAGES || m < BENCH_PAGES){
+    printf("bench: out of memory (%d/%d pages)\n", n < m ? n : m, (int)BENCH_PAGES);
+    return;
+  }
+  printf("bench: kalloc+kfree  per-page %llu cycles/MiB, batch %llu cycles/MiB, saved %lld\n",
+         single, batch, (long long)(single - batch));
+
+  // --- 地址空间增长与销毁：BENCH_VM_MB MiB ---
+  uint64 sz = BENCH_VM_MB * MB;
+
+  // 基准：每页一次 kalloc + mappages，销毁时每页一次 walk + kfree
+  pagetable_t pt = proc_pagetable_create();
+  if(pt == 0)
+    return;
+  t0 = r_cycle();
+  for(uint64 a = USERBASE; a < USERBASE + sz; a += PGSIZE){
+    void *mem = kalloc();
+    if(mem == 0 || mappages(pt, a, PGSIZE, VA2PA(mem), PTE_R | PTE_W | PTE_U) != 0)
+      panic("bench_kalloc_batch: baseline alloc");
+  }
+  for(uint64 a = USERBASE; a < USERBASE + sz; a += PGSIZE){
+    pte_t *pte = walk(pt, a, 0);
+    kfree(PA2VA(pte_to_pa(*pte)));
+    *pte = 0;
+  }
+  sfence_vma();
+  uint64 vm_single = r_cycle() - t0;
+  freevm(pt, 0);
+
+  // 批量路径：uvmalloc + freevm
+  pt = proc_pagetable_create();
+  if(pt == 0)
+    return;
+  t0 = r_cycle();
+  if(uvmalloc(pt, USERBASE, USERBASE + sz) != 0)
+    panic("bench_kalloc_batch: uvmalloc");
+  freevm(pt, USERBASE + sz);
+  uint64 vm_batch = r_cycle() - t0;
+
+  printf("bench: vm grow+free  per-page %llu cycles/MiB, batch %llu cycles/MiB, saved %lld\n",
+         vm_single / BENCH_VM_MB, vm_batch / BENCH_VM_MB,
+         (long long)(vm_single - vm_batch) / BENCH_VM_MB);
+}
+
+#define BENCH_SLAB_OBJS 256         // 每个大小类分配的对象数
+
+static void *bench_objs[BENCH_SLAB_OBJS];
+
+// 每个 slab 大小类（16..1024 字节）各分配、释放 BENCH_SLAB_OBJS 个对象：
+// 检查分配计数和 slab 页数在动，kmem_slab_reclaim() 之后空 slab 都还给了
+// kalloc()；再确认大对象按实际大小取页块（kmalloc(PGSIZE) 只占一页）。
+void bench_slab(void) {
+  printf("bench: slab kmalloc/kfree_obj per size class\n");
+  kmem_slab_reclaim();
+  uint64 free0 = kmem_free_pages();
+  uint64 base = kmem_slab_pages();
+
+  for(uint64 size = 16; size <= 1024; size <<= 1){
+    uint64 allocs = kmem_slab_alloc_count();
+    uint64 kallocs = kmem_alloc_count();
+    uint64 t0 = r_cycle();
+    for(int i = 0; i < BENCH_SLAB_OBJS; i++)
+      if((bench_objs[i] = kmalloc(size)) == 0)
+        panic("bench_slab: kmalloc");
+    uint64 talloc = r_cycle() - t0;
+    uint64 pages = kmem_slab_pages() - base;
+    if(kmem_slab_alloc_count() - allocs != BENCH_SLAB_OBJS || pages == 0)
+      panic("bench_slab: counters did not move");
+    uint64 kpages = kmem_alloc_count() - kallocs;
+
+    t0 = r_cycle();
+    for(int i = 0; i < BENCH_SLAB_OBJS; i++)
+      kfree_obj(bench_objs[i]);
+    uint64 tfree = r_cycle() - t0;
+    uint64 back = kmem_slab_reclaim();
+    if(kmem_slab_pages() != base)
+      panic("bench_slab: empty slabs not returned");
+
+    printf("bench: slab %llu bytes  alloc %llu cycles/obj, free %llu cycles/obj, "
+           "%llu slab pages, %llu kalloc calls, %llu reclaimed at the end\n",
+           size, talloc / BENCH_SLAB_OBJS, tfree / BENCH_SLAB_OBJS,
+           pages, kpages, back);
+  }
+
+  // 大对象：页块的阶数记在页帧表里，不占块内空间
+  void *one = kmalloc(PGSIZE), *two = kmalloc(PGSIZE + 1);
+  if(one == 0 || two == 0)
+    panic("bench_slab: large kmalloc");
+  if(kmem_page_order(one) != 0 || kmem_page_order(two) != 1)
+    panic("bench_slab: large object order");
+  kfree_obj(one);
+  kfree_obj(two);
+
+  if(kmem_free_pages() < free0)
+    panic("bench_slab: pages leaked");
+  printf("bench: kalloc %llu allocs, slab %llu allocs\n",
+         (uint64)kmem_alloc_count(), (uint64)kmem_slab_alloc_count());
+  kmem_print_slabs();
+}
+
+// 用 4KB 页和大页分别建立一份 [KERNBASE, PHYSTOP) 的恒等映射，
+// 比较建表时间和页表占用的内存（即 kvminit 改用大页前后的差别）。
+void bench_kvm_superpage(void) {
+  static const char *names[] = { "4KB", "2MB/1GB" };
+  static const int maxlevel[] = { 0, 2 };
+
+  printf("bench: kernel identity map, 4KB vs superpages\n");
+  for(int i = 0; i < 2; i++){
+    uint64 before = vm_pagetable_pages();
+    uint64 t0 = r_time();
+    pagetable_t pt = kvm_pagetable_create();
+    if(pt == 0 ||
+       mappages_level(pt, KERNBASE, PHYSTOP - KERNBASE, KERNBASE,
+                      PTE_R | PTE_W | PTE_X, maxlevel[i]) != 0)
+      panic("bench_kvm_superpage: map");
+    uint64 ticks = r_time() - t0;
+    uint64 tables = vm_pagetable_pages() - before;
+    printf("bench: %s leaves: %llu ticks, %llu page-table pages (%llu KiB)\n",
+           names[i], ticks, tables, tables * PGSIZE / 1024);
+    // freevm 只释放页表页；恒等映射的物理页不属于分配器
+    freevm(pt, 0);
+  }
+}
+
+#define COW_DENSE_MB 16                 // 稠密映像：连续 16 MiB
+#define COW_SPARSE_SPAN (1UL << 30)     // 稀疏映像：1 GiB 地址范围……
+#define COW_SPARSE_STRIDE (2 * MB)      // ……每 2 MiB 只有一页
+
+// 复制一份地址空间：eager 为 1 用 copyuvm（逐页拷贝），为 0 用 copyuvm_cow（共享）。
+// 返回所用周期数，并顺带测出子进程第一次写每一页的代价（直接调用缺页处理函数）。
+static uint64 cow_fork_once(pagetable_t parent, uint64 sz, int eager, uint64 *touch) {
+  uint64 t0 = r_cycle();
+  pagetable_t child = eager ? copyuvm(parent, sz) : copyuvm_cow(parent, sz);
+  uint64 t = r_cycle() - t0;
+  if(child == 0)
+    panic("bench_cow_fork: copy");
+
+  // 模拟子进程把每一页都写一遍：COW 时每页一次缺页 + 拷贝
+  t0 = r_cycle();
+  if(!eager){
+    struct pt_cursor c;
+    ptc_init(&c, child, 0);
+    uint64 va = USERBASE;
+    int level;
+    while(ptc_next(&c, &va, sz, &level) != 0){
+      if(vm_fault(child, va, 15) != 0)
+        panic("bench_cow_fork: fault");
+      va += PGSIZE;
+    }
+  }
+  *touch = r_cycle() - t0;
+
+  freevm(child, sz);
+  return t;
+}
+
+static void cow_fork_report(const char *name, pagetable_t parent, uint64 sz, int pages) {
+  uint64 et, ct, touch;
+  et = cow_fork_once(parent, sz, 1, &touch);
+  ct = cow_fork_once(parent, sz, 0, &touch);
+  printf("bench: %s (%d pages): copy %llu cycles, cow %llu cycles, cow+write-all %llu cycles\n",
+         name, pages, et, ct, ct + touch);
+}
+
+// fork 式复制地址空间：逐页拷贝与写时复制的对比，分别用稠密和稀疏两种映像
+void bench_cow_fork(void) {
+  printf("bench: fork-style copy vs copy-on-write\n");
+
+  // 稠密：从 USERBASE 起 COW_DENSE_MB MiB 全部映射（sz 是用户空间的上界）
+  uint64 sz = USERBASE + COW_DENSE_MB * MB;
+  pagetable_t pt = proc_pagetable_create();
+  if(pt == 0 || uvmalloc(pt, USERBASE, sz) != 0)
+    panic("bench_cow_fork: dense");
+  cow_fork_report("dense", pt, sz, (int)(COW_DENSE_MB * MB / PGSIZE));
+  freevm(pt, sz);
+
+  // 稀疏：COW_SPARSE_SPAN 范围内每 COW_SPARSE_STRIDE 一页
+  sz = USERBASE + COW_SPARSE_SPAN;
+  int n = 0;
+  pt = proc_pagetable_create();
+  if(pt == 0)
+    panic("bench_cow_fork: sparse");
+  for(uint64 a = USERBASE; a < sz; a += COW_SPARSE_STRIDE, n++){
+    if(uvmalloc(pt, a, a + PGSIZE) != 0)
+      panic("bench_cow_fork: sparse");
+  }
+  cow_fork_report("sparse", pt, sz, n);
+  freevm(pt, sz);
+
+  uint64 faults, copies;
+  vm_cow_stats(&faults, &copies);
+  printf("bench: cow faults %llu, copies %llu\n", faults, copies);
+}
+
+#define LAZY_MB 32          // 预留的堆大小
+#define LAZY_TOUCH 16       // 每 16 页写一页、读一页，其余不碰
+
+// 一次性分配（uvmalloc）与按需分配（uvmalloc_lazy + 缺页）的对比：
+// 预留 LAZY_MB MiB，只访问其中一小部分，比较耗时和实际占用的物理页
+void bench_lazy_alloc(void) {
+  printf("bench: eager vs lazy uvmalloc\n");
+  uint64 sz = USERBASE + LAZY_MB * MB;
+
+  pagetable_t pt = proc_pagetable_create();
+  if(pt == 0)
+    panic("bench_lazy_alloc: pagetable");
+  uint64 t0 = r_cycle();
+  if(uvmalloc(pt, USERBASE, sz) != 0)
+    panic("bench_lazy_alloc: uvmalloc");
+  uint64 eager = r_cycle() - t0;
+  uint64 eager_pages = vm_resident_pages(pt, sz);
+  uint64 huge, fallbacks;
+  vm_huge_stats(&huge, &fallbacks);
+  printf("bench: eager heap uses %llu 2MB huge pages (%llu fell back to 4KB)\n",
+         huge, fallbacks);
+  freevm(pt, sz);
+
+  pt = proc_pagetable_create();
+  if(pt == 0)
+    panic("bench_lazy_alloc: pagetable");
+  uint64 f0, z0, f1, z1;
+  vm_lazy_stats(&f0, &z0);
+  t0 = r_cycle();
+  if(uvmalloc_lazy(pt, USERBASE, sz) != 0)
+    panic("bench_lazy_alloc: uvmalloc_lazy");
+  // 内核不能直接访问 PTE_U 页，这里直接调用缺页处理函数模拟第一次访问
+  for(uint64 a = USERBASE; a < sz; a += LAZY_TOUCH * PGSIZE){
+    if(vm_fault(pt, a, 15) != 0 || vm_fault(pt, a + PGSIZE, 13) != 0)
+      panic("bench_lazy_alloc: fault");
+  }
+  uint64 lazy = r_cycle() - t0;
+  vm_lazy_stats(&f1, &z1);
+  printf("bench: eager %llu cycles, %llu pages; lazy %llu cycles, %llu pages\n",
+         eager, eager_pages, lazy, vm_resident_pages(pt, sz));
+  printf("bench: lazy faults %llu, zero-page hits %llu\n", f1 - f0, z1 - z0);
+  freevm(pt, sz);
+}
+
+#define REMAP_SRC_MB 4                    // 源：eager uvmalloc，2 MiB 大页
+#define REMAP_MOVE (USERBASE + MB)        // 从第一个大页中间搬走……
+#define REMAP_RO (USERBASE + 2 * MB + 3 * PGSIZE)  // ……从第二个大页中间只读共享
+#define REMAP_SIZE (256 * 1024)
+#define REMAP_DST (USERBASE + 64 * MB)    // 目标地址空间里的位置
+#define REMAP_DST_RO (REMAP_DST + 2 * MB)
+
+// 检查 dst 里 [dva, dva+REMAP_SIZE) 映射的正是 pas[] 那些物理页，内容没变
+static void remap_check(pagetable_t dst, uint64 dva, uint64 *pas, char *what) {
+  for(int i = 0; i < REMAP_SIZE / PGSIZE; i++){
+    uint64 pa = walkaddr(dst, dva + (uint64)i * PGSIZE);
+    if(pa != pas[i] || *(uint64 *)PA2VA(pa) != pas[i])
+      panic(what);
+  }
+}
+
+// 零拷贝重映射：MOVE 和 SHARE_RO 各一次，源都在 2 MiB 大页里而且不对齐
+// （要拆到 4 KiB），和同样大小的 memcpy 比；最后确认对只读目标的写被拒绝
+void bench_vm_remap(void) {
+  printf("bench: vm_remap vs copy\n");
+  static uint64 pas[REMAP_SIZE / PGSIZE];
+  uint64 sz = USERBASE + REMAP_SRC_MB * MB;
+  pagetable_t src = proc_pagetable_create(), dst = proc_pagetable_create();
+  if(src == 0 || dst == 0)
+    panic("bench_vm_remap: pagetable");
+  if(uvmalloc(src, USERBASE, sz) != 0)
+    panic("bench_vm_remap: uvmalloc");
+  int level;
+  walk_level(src, REMAP_MOVE, 0, 0, &level);
+  if(level == 0)
+    printf("bench: (no huge page for the source, splitting not exercised)\n");
+
+  // 基准：把同样多的页复制一遍
+  void *buf = kalloc_pages(6);
+  uint64 copy = 0;
+  if(buf){
+    uint64 t0 = r_cycle();
+    memcpy(buf, PA2VA(walkaddr(src, REMAP_MOVE)), REMAP_SIZE);
+    copy = r_cycle() - t0;
+    kfree_pages(buf, 6);
+  }
+
+  // MOVE：每页写上自己的物理地址，搬过去以后在 dst 里核对，src 里应该没了
+  for(int i = 0; i < REMAP_SIZE / PGSIZE; i++){
+    pas[i] = walkaddr(src, REMAP_MOVE + (uint64)i * PGSIZE);
+    *(uint64 *)PA2VA(pas[i]) = pas[i];
+  }
+  uint64 t0 = r_cycle();
+  if(vm_remap(src, REMAP_MOVE, dst, REMAP_DST, REMAP_SIZE, VM_REMAP_MOVE) != 0)
+    panic("bench_vm_remap: move");
+  uint64 move = r_cycle() - t0;
+  remap_check(dst, REMAP_DST, pas, "bench_vm_remap: move target");
+  for(uint64 a = REMAP_MOVE; a < REMAP_MOVE + REMAP_SIZE; a += PGSIZE)
+    if(walkaddr(src, a) != 0)
+      panic("bench_vm_remap: move source still mapped");
+
+  // SHARE_RO：目标同时是按需分配的范围，对它的写不能被当成首次访问
+  if(uvmalloc_lazy(dst, REMAP_DST_RO, REMAP_DST_RO + REMAP_SIZE) != 0)
+    panic("bench_vm_remap: uvmalloc_lazy");
+  for(int i = 0; i < REMAP_SIZE / PGSIZE; i++){
+    pas[i] = walkaddr(src, REMAP_RO + (uint64)i * PGSIZE);
+    *(uint64 *)PA2VA(pas[i]) = pas[i];
+  }
+  t0 = r_cycle();
+  if(vm_remap(src, REMAP_RO, dst, REMAP_DST_RO, REMAP_SIZE, VM_REMAP_SHARE_RO) != 0)
+    panic("bench_vm_remap: share");
+  uint64 share = r_cycle() - t0;
+  remap_check(dst, REMAP_DST_RO, pas, "bench_vm_remap: share target");
+  if(walkaddr(src, REMAP_RO) != pas[0])
+    panic("bench_vm_remap: share source");
+  if(*walk(dst, REMAP_DST_RO, 0) & PTE_W)
+    panic("bench_vm_remap: share target writable");
+  // 内核不能直接写 PTE_U 页，这里直接调用缺页处理函数模拟一次写
+  if(vm_fault(dst, REMAP_DST_RO, 15) == 0)
+    panic("bench_vm_remap: store to read-only target accepted");
+
+  printf("bench: %d KiB copy %llu cycles, move %llu cycles, share read-only %llu cycles\n",
+         REMAP_SIZE / 1024, copy, move, share);
+  freevm(dst, REMAP_DST_RO + REMAP_SIZE);
+  freevm(src, sz);
+}
+
+#define TLB_BASE USERBASE
+#define TLB_PAGES 64            // 每个地址空间访问的页数
+#define TLB_ROUNDS 200
+
+// 造一个地址空间：共享的内核映射，外加 TLB_PAGES 个用户页
+static pagetable_t tlb_space(void) {
+  pagetable_t pt = proc_pagetable_create();
+  if(pt == 0)
+    panic("bench_tlb_asid: pagetable");
+  if(uvmalloc(pt, TLB_BASE, TLB_BASE + TLB_PAGES * PGSIZE) != 0)
+    panic("bench_tlb_asid: uvmalloc");
+  return pt;
+}
+
+
+static void tlb_touch(void) {
+  for(int i = 0; i < TLB_PAGES; i++)
+    (void)*(volatile uint64 *)(TLB_BASE + (uint64)i * PGSIZE);
+}
+
+// 两个地址空间来回切换，每次切换后访问 TLB_PAGES 页：
+// 旧做法是 satp 不带 ASID、每次切换全局 sfence.vma；新做法是 vm_switch()（带 ASID，不刷新）
+void bench_tlb_asid(void) {
+  printf("bench: address-space switch + TLB refill, global flush vs ASID\n");
+  pagetable_t a = tlb_space(), b = tlb_space();
+
+  int intr = intr_save();
+  w_sstatus(r_sstatus() | SSTATUS_SUM);   // 允许 S 模式访问 PTE_U 页
+
+  uint64 t0 = r_cycle();
+  for(int r = 0; r < TLB_ROUNDS; r++){
+    w_satp(MAKE_SATP(VA2PA(a)));
+    sfence_vma();
+    tlb_touch();
+    w_satp(MAKE_SATP(VA2PA(b)));
+    sfence_vma();
+    tlb_touch();
+  }
+  uint64 global = r_cycle() - t0;
+
+  // 上面的表项都记在 ASID 0（内核）名下，先清掉
+  sfence_vma();
+  vm_switch(kernel_pagetable);
+  t0 = r_cycle();
+  for(int r = 0; r < TLB_ROUNDS; r++){
+    vm_switch(a);
+    tlb_touch();
+    vm_switch(b);
+    tlb_touch();
+  }
+  uint64 asid = r_cycle() - t0;
+
+  vm_switch(kernel_pagetable);
+  w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+  intr_restore(intr);
+
+  printf("bench: global flush %llu cycles/switch, ASID %llu cycles/switch (%llu rollovers)\n",
+         global / (2 * TLB_ROUNDS), asid / (2 * TLB_ROUNDS), vm_asid_rollovers());
+  freevm(a, TLB_BASE + TLB_PAGES * PGSIZE);
+  freevm(b, TLB_BASE + TLB_PAGES * PGSIZE);
+}
+
+#define SWAP_EXTRA_MB 16    // 比空闲内存多要这么多
+#define SWAP_GROW_MB 4      // 每次 uvmalloc 增长的大小
+#define SWAP_CHECK 63       // 每 63 页抽查一页（与 4 互素，三种页都会抽到）
+
+// 第 i 页的内容：i%4==0 填满随机数（压不动，只能去磁盘），
+// i%4==1 不碰（全零页），其余只在开头写上自己的虚拟地址（很好压）
+static uint64
+swap_fill(uint64 *p, uint64 va, int i)
+{
+  if(i % 4 == 1)
+    return 0;
+  if(i % 4 == 0){
+    uint64 x = va | 1;
+    for(int k = 1; k < PGSIZE / 8; k++){
+      x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+      p[k] = x;
+    }
+  }
+  p[0] = va;
+  return va;
+}
+
+// 内存超卖：用户堆增长到“空闲内存 + SWAP_EXTRA_MB”，靠回收把页换出
+// （全零页只留标记，能压缩的进压缩池，其余写磁盘）；
+// 然后抽查若干页，缺页换入后内容应当和写入时一致
+void bench_swap(void) {
+  printf("bench: overcommit with swap\n");
+  if(!swap_enabled()){
+    printf("bench: no swap, skipped\n");
+    return;
+  }
+  uint64 sz = USERBASE + kmem_free_pages() * PGSIZE + SWAP_EXTRA_MB * MB;
+  sz &= ~(SWAP_GROW_MB * MB - 1);
+  pagetable_t pt = proc_pagetable_create();
+  if(pt == 0)
+    panic("bench_swap: pagetable");
+
+  uint64 o0, i0, o1, i1;
+  swap_stats(&o0, &i0);
+  uint64 t0 = r_cycle();
+  for(uint64 a = USERBASE; a < sz; a += SWAP_GROW_MB * MB){
+    if(uvmalloc(pt, a, a + SWAP_GROW_MB * MB) != 0){
+      printf("bench: uvmalloc failed at %llu MiB\n", (a - USERBASE) / MB);
+      sz = a;
+      break;
+    }
+    // 通过恒等映射写入内容
+    for(uint64 va = a; va < a + SWAP_GROW_MB * MB; va += PGSIZE)
+      swap_fill((uint64 *)walkaddr(pt, va), va, (va - USERBASE) / PGSIZE);
+  }
+  uint64 grow = r_cycle() - t0;
+  swap_stats(&o1, &i1);
+  printf("bench: %llu MiB heap in %llu cycles, %llu pages swapped out, %llu slots in use\n",
+         (sz - USERBASE) / MB, grow, o1 - o0, (uint64)swap_used_slots());
+
+  int checked = 0, bad = 0;
+  t0 = r_cycle();
+  for(uint64 va = USERBASE; va < sz; va += SWAP_CHECK * PGSIZE, checked++){
+    if(walkaddr(pt, va) == 0 && vm_fault(pt, va, 13) != 0)
+      panic("bench_swap: swap-in");
+    uint64 want = (va - USERBASE) / PGSIZE % 4 == 1 ? 0 : va;
+    if(*(uint64 *)walkaddr(pt, va) != want)
+      bad++;
+  }
+  uint64 back = r_cycle() - t0;
+  swap_stats(&o1, &i1);
+  printf("bench: checked %d pages (%d bad), %llu swapped in, %llu cycles\n",
+         checked, bad, i1 - i0, back);
+
+  uint64 scanned, evicted;
+  vm_reclaim_stats(&scanned, &evicted);
+  printf("bench: reclaim scanned %llu, evicted %llu\n", scanned, evicted);
+  swap_print_stats();
+  freevm(pt, sz);
+  printf("bench: after free %llu slots in use\n", (uint64)swap_used_slots());
+}
+
+#define TRAP_ROUNDS 1000
+
+#define TRAP_TIMER 0
+#define TRAP_SOFT 1
+#define TRAP_EBREAK 2
+#define TRAP_NONE 3         // 什么也不触发，只量开关中断本身
+
+void kernelvec();
+void kernelvec_table();
+
+// 关中断，让一个 kind 类型的 trap 挂起，再开中断让它进来，
+// 返回从开中断到处理完回来的周期数
+static uint64
+trap_once(int kind)
+{
+  intr_off();
+  if(kind == TRAP_TIMER)
+    w_stimecmp(0);              // time >= stimecmp，时钟中断立刻挂起
+  else if(kind == TRAP_SOFT)
+    w_sip(r_sip() | SIP_SSIP);
+  uint64 t0 = r_cycle();
+  if(kind == TRAP_EBREAK){
+    asm volatile("ebreak");
+  } else {
+    intr_on();
+    intr_off();
+  }
+  return r_cycle() - t0;
+}
+
+// 跑 TRAP_ROUNDS 次，扣掉基线后给出最小值和平均值
+static void
+trap_measure(int kind, uint64 base, uint64 *min, uint64 *avg)
+{
+  uint64 lo = ~0UL, sum = 0;
+  for(int r = 0; r < TRAP_ROUNDS; r++){
+    uint64 c = trap_once(kind);
+    c = c > base ? c - base : 0;
+    if(c < lo)
+      lo = c;
+    sum += c;
+  }
+  *min = lo;
+  *avg = sum / TRAP_ROUNDS;
+}
+
+// 各条 trap 路径的往返开销：时钟/软件中断分别走向量模式下
+// 只保存调用者保存寄存器的入口，和临时切回直接模式后的完整保存路径；
+// 异常（ebreak）总是走完整保存的 kernelvec
+void bench_trap_paths(void) {
+  printf("bench: trap round trips, %d rounds\n", TRAP_ROUNDS);
+  uint64 base, dummy;
+  trap_measure(TRAP_NONE, 0, &base, &dummy);
+
+  uint64 tmin, tavg, smin, savg, emin, eavg;
+  uint64 ftmin, ftavg, fsmin, fsavg;
+  trap_measure(TRAP_TIMER, base, &tmin, &tavg);
+  trap_measure(TRAP_SOFT, base, &smin, &savg);
+  trap_measure(TRAP_EBREAK, 0, &emin, &eavg);
+
+  w_stvec((uint64)kernelvec | STVEC_MODE_DIRECT);
+  trap_measure(TRAP_TIMER, base, &ftmin, &ftavg);
+  trap_measure(TRAP_SOFT, base, &fsmin, &fsavg);
+  w_stvec((uint64)kernelvec_table | STVEC_MODE_VECTORED);
+
+  // 最后一次时钟中断已经按定时器队列重新设置了 stimecmp
+  intr_on();
+
+  printf("bench: baseline %llu cycles (intr on/off)\n", base);
+  printf("bench: timer  vectored min %llu avg %llu, full save min %llu avg %llu\n",
+         tmin, tavg, ftmin, ftavg);
+  printf("bench: soft   vectored min %llu avg %llu, full save min %llu avg %llu\n",
+         smin, savg, fsmin, fsavg);
+  printf("bench: ebreak full save min %llu avg %llu\n", emin, eavg);
+  intr_print_stats();
+  trapstat_dump();
+  plic_print_stats();
+  uart_print_stats();
+}
+
+#define PLIC_ROUNDS 1000
+#define PLIC_WAIT (TIMER_HZ / 4)    // 0.25 秒，均衡器应该至少看过两次
+
+// PLIC 亲和性、阈值和均衡器：设置以后用 plic_get_affinity() 核对，
+// 量一次改亲和性的开销；均衡器打开一会儿再关掉，确认它真的跑过
+void bench_plic(void) {
+  printf("bench: plic affinity / threshold / balancer\n");
+  int hart = cpuid();
+  int uart = plic_get_affinity(UART0_IRQ), disk = plic_get_affinity(VIRTIO0_IRQ);
+
+  uint64 t0 = r_cycle();
+  for(int i = 0; i < PLIC_ROUNDS; i++)
+    if(plic_set_affinity(UART0_IRQ, hart) != 0)
+      panic("bench_plic: set_affinity");
+  uint64 set = (r_cycle() - t0) / PLIC_ROUNDS;
+  if(plic_get_affinity(UART0_IRQ) != hart)
+    panic("bench_plic: affinity");
+  // 别的核：在线就挪过去，没调用过 plicinithart() 的要拒绝、原地不动
+  for(int h = 0; h < NCPU; h++){
+    if(h == hart)
+      continue;
+    int ok = plic_set_affinity(UART0_IRQ, h) == 0;
+    if(plic_get_affinity(UART0_IRQ) != (ok ? h : hart))
+      panic("bench_plic: affinity to another hart");
+    plic_set_affinity(UART0_IRQ, hart);
+  }
+  if(plic_set_affinity(UART0_IRQ, NCPU) == 0 || plic_set_affinity(0, hart) == 0)
+    panic("bench_plic: bad affinity accepted");
+
+  // 本核只收交互设备：磁盘挪到别的在线核上，没有就留在本核（已被阈值屏蔽）
+  plic_set_threshold(hart, PLIC_PRIO_BULK);
+  if(*(volatile uint32 *)PLIC_SPRIORITY(hart) != PLIC_PRIO_BULK)
+    panic("bench_plic: threshold");
+  if(plic_get_affinity(UART0_IRQ) != hart)
+    panic("bench_plic: uart moved by threshold");
+  int masked = plic_get_affinity(VIRTIO0_IRQ);
+  plic_set_threshold(hart, 0);
+
+  uint64 runs = plic_balance_runs();
+  plic_balancer(1);
+  uint64 until = r_time() + PLIC_WAIT;
+  while(r_time() < until)
+    ;
+  plic_balancer(0);
+  runs = plic_balance_runs() - runs;
+  if(runs == 0)
+    panic("bench_plic: balancer never ran");
+
+  printf("bench: set_affinity %llu cycles, disk on hart %d under threshold, balancer ran %llu times\n",
+         set, masked, runs);
+  plic_set_affinity(UART0_IRQ, uart);
+  plic_set_affinity(VIRTIO0_IRQ, disk);
+  plic_print_stats();
+}
+
+#define WB_MAX 100000
+#define WB_PER_PAGE (PGSIZE / sizeof(struct wtimer))
+#define WB_PAGES ((WB_MAX + WB_PER_PAGE - 1) / WB_PER_PAGE)
+
+static struct wtimer *wb_pages[WB_PAGES];
+static volatile uint64 wb_fired;
+
+static struct wtimer *
+wb_timer(int i)
+{
+  return &wb_pages[i / WB_PER_PAGE][i % WB_PER_PAGE];
+}
+
+static void
+wb_expire(void *arg)
+{
+  wb_fired++;
+}
+
+// n 个超时：随机挂在 60 秒内再全部取消，然后挂 n 个 100 毫秒内到期的，
+// 等它们全部到期。到期的开销按轮子推进时花的周期数（含级联和回调）平摊
+static void
+wheel_round(int n)
+{
+  uint64 x = 88172645463325252UL;
+  uint64 now = r_time();
+  uint64 t0 = r_cycle();
+  for(int i = 0; i < n; i++){
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    wtimer_add(wb_timer(i), now + (1 + x % 60000) * WHEEL_TICK, wb_expire, 0);
+  }
+  uint64 arm = r_cycle() - t0;
+  t0 = r_cycle();
+  for(int i = 0; i < n; i++)
+    wtimer_cancel(wb_timer(i));
+  uint64 cancel = r_cycle() - t0;
+
+  struct wheel_stats s0, s1;
+  wheel_get_stats(&s0);
+  wb_fired = 0;
+  now = r_time();
+  for(int i = 0; i < n; i++){
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    wtimer_add(wb_timer(i), now + (1 + x % 100) * WHEEL_TICK, wb_expire, 0);
+  }
+  uint64 limit = r_time() + 5 * TIMER_HZ;
+  while(wb_fired < n && r_time() < limit)
+    ;
+  wheel_get_stats(&s1);
+  uint64 expired = s1.expired - s0.expired;
+  // 超时没等完的也摘掉，页马上要还回去
+  for(int i = 0; i < n; i++)
+    wtimer_cancel(wb_timer(i));
+
+  printf("bench: %d timers: arm %llu cycles, cancel %llu cycles, expire %llu cycles each\n",
+         n, arm / n, cancel / n, expired ? (s1.run_cycles - s0.run_cycles) / expired : 0);
+  printf("bench: %llu/%d expired in %llu wheel runs, %llu cascaded\n",
+         expired, n, s1.runs - s0.runs, s1.cascaded - s0.cascaded);
+}
+
+// 时间轮压力测试：1 万和 10 万个并发超时
+void bench_timer_wheel(void) {
+  printf("bench: timer wheel\n");
+  int npages = 0;
+  for(; npages < WB_PAGES; npages++)
+    if((wb_pages[npages] = kalloc()) == 0)
+      break;
+  int max = npages * WB_PER_PAGE;
+  if(max > WB_MAX)
+    max = WB_MAX;
+  wheel_round(max < 10000 ? max : 10000);
+  if(max < WB_MAX)
+    printf("bench: only %d timers fit\n", max);
+  wheel_round(max);
+  wheel_print_stats();
+  // 到期处理在 softirq 里做，看看每批花了多久
+  softirq_print_stats();
+  for(int i = 0; i < npages; i++)
+    kfree(wb_pages[i]);
+}
@@ -1,6 +1,8 @@
 // console.c - console device (no lock version)
 #include "types.h"
 #include "defs.h"
+#include "trapstat.h"
+#include "softirq.h"
 
 void consoleinit(void) {
   uartinit();
@@ -14,6 +16,30 @@ void consputc(int c) {
   uartputc(c);
 }
 
+#define C(x)  ((x)-'@')  // Control-x
+
+// 键盘输入（uart.c 的下半部调用）。目前只回显；
+// Ctrl-T 打印中断统计
+void consoleintr(int c) {
+  switch (c) {
+  case C('T'):
+    trapstat_dump();
+    softirq_print_stats();
+    plic_print_stats();
+    uart_print_stats();
+    break;
+  case '\r':
+    consputc('\n');
+    break;
+  case '\x7f':
+    uartputs("\b \b");
+    break;
+  default:
+    consputc(c);
+    break;
+  }
+}
+
 // 清屏（ANSI 转义序列）
 void clear(void) {
   // \033[2J 清屏，\033[H 光标回到左上角, \033[3J真正的清屏
@@ -2,6 +2,19 @@
 #define DEFS_H
 
 #include "types.h"
+// bench.c
+void            bench_kalloc_batch(void);
+void            bench_slab(void);
+void            bench_kvm_superpage(void);
+void            bench_cow_fork(void);
+void            bench_lazy_alloc(void);
+void            bench_vm_remap(void);
+void            bench_tlb_asid(void);
+void            bench_swap(void);
+void            bench_trap_paths(void);
+void            bench_plic(void);
+void            bench_timer_wheel(void);
+
 // bio.c
 
 
@@ -9,6 +22,7 @@
 void            consoleinit(void);
 void            clear(void);
 void            consputc(int);
+void            consoleintr(int);
 void            goto_xy(int x, int y);
 void            clear_line(void);
 // exec.c
@@ -27,6 +41,7 @@ void            clear_line(void);
 void            printf(const char *fmt, ...);
 void            printf_color(int color, const char *fmt, ...);
 void            panic(char *s);
+extern volatile int panicked;
 // proc.c
 
 // swtch.S
@@ -41,10 +56,16 @@ void            panic(char *s);
 
 // trap.c
 void            trapinithart(void);
+int             intr_nest_on(void);
+void            intr_nest_off(int);
+void            intr_print_stats(void);
 // uart.c
 void            uartinit(void);
 void            uartputs(const char *s);
 void            uartputc(int);
+void            uartputc_sync(int);
+void            uart_tx_drop(int on);
+void            uart_print_stats(void);
 void            uartintr(void);
 
 // vm.c
@@ -54,7 +75,16 @@ void            plicinit(void);
 void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
+int             plic_set_affinity(int irq, int hart);
+int             plic_get_affinity(int irq);
+void            plic_set_threshold(int hart, int threshold);
+void            plic_balancer(int on);
+uint64          plic_balance_runs(void);
+void            plic_print_stats(void);
 // virtio_disk.c
+int             virtio_disk_init(void);
+uint64          virtio_disk_capacity(void);
+int             virtio_disk_rw(uint64 sector, void *buf, uint32 len, int write);
 void            virtio_disk_intr(void);
 
 #endif // DEFS_H
@@ -1,5 +1,7 @@
-// kalloc.c - simple page frame allocator (freelist in-page)
+// kalloc.c - page frame allocator (buddy lists + per-hart page caches)
 #include "kmem.h"
+#include "param.h"
+#include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
 #include <stddef.h>
@@ -24,98 +26,651 @@ static struct spinlock kmem_lock;
 #define KMEM_UNLOCK() ((void)0)
 #endif
 
+// Per-hart page cache ("magazine") sizing.
+// A hart refills KMEM_PCP_BATCH pages at a time when its cache is empty and
+// gives KMEM_PCP_BATCH pages back once it holds more than KMEM_PCP_HIGH.
+#ifndef KMEM_PCP_BATCH
+#define KMEM_PCP_BATCH 16
+#endif
+#ifndef KMEM_PCP_HIGH
+#define KMEM_PCP_HIGH 64
+#endif
+// Pages kept pre-zeroed by kmem_zero_idle(), and how many it clears per call.
+#ifndef KMEM_ZERO_TARGET
+#define KMEM_ZERO_TARGET 256
+#endif
+#ifndef KMEM_ZERO_STEP
+#define KMEM_ZERO_STEP 8
+#endif
+// kinit() only onlines the first KMEM_EAGER_BYTES of the range. The rest is
+// brought online KMEM_ONLINE_CHUNK bytes at a time, when the buddy lists run
+// dry or from the idle loop (kmem_online_idle()).
+#ifndef KMEM_EAGER_BYTES
+#define KMEM_EAGER_BYTES (4UL * 1024 * 1024)
+#endif
+#ifndef KMEM_ONLINE_CHUNK
+#define KMEM_ONLINE_CHUNK (8UL * 1024 * 1024)
+#endif
+
+// Free pages are kept by a binary buddy allocator: a free block of order k
+// is 2^k physically contiguous pages, aligned to its own size. The first page
+// of each free block holds the list links.
 struct run {
     struct run *next;
+    struct run *prev;   // only meaningful on the buddy lists
+};
+
+// Frames are numbered by physical address from KERNBASE, so that block
+// alignment is physical alignment. Both macros take/return kernel VAs.
+#define KMEM_NFRAMES ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2FRAME(va) ((VA2PA(va) - KERNBASE) >> PGSHIFT)
+#define FRAME2PA(i) PA2VA(KERNBASE + ((uint64_t)(i) << PGSHIFT))
+
+struct free_area {
+    struct run *head;
+    size_t nblocks;
+};
+
+static struct free_area free_area[KMEM_MAX_ORDER + 1];
+// Page frame database: one descriptor per frame in [KERNBASE, PHYSTOP).
+// state is only changed at the API boundary (alloc/free/set_state), so the
+// checks in kfree() are O(1) and stay on in production builds.
+struct page {
+    uint32_t state;     // PG_* from kmem.h
+    uint32_t refcnt;    // references to an allocated block head
+    uint8_t order;      // allocated block heads: order of the block
+    uint8_t buddy;      // k + 1 when the frame heads a free buddy block of order k
+    uint16_t pad;
 };
 
-static struct run *freelist = NULL;
+static struct page pages[KMEM_NFRAMES];
 static size_t total_pages_count = 0;
-static size_t free_pages_count = 0;
-static size_t alloc_ops = 0;
+static size_t free_pages_count = 0;   // pages on the buddy lists only
 
-/* Optionally enable KMEM_DEBUG in your build to perform slow checks */
-// #define KMEM_DEBUG
+// [offline_start, offline_end) is managed but not yet on the buddy lists.
+static uintptr_t offline_start = 0;
+static uintptr_t offline_end = 0;
+
+// Pages already cleared in the background, ready for kalloc() to hand out.
+static struct run *zero_pool = NULL;
+static size_t zero_pool_count = 0;
+
+// Per-hart cache, indexed by cpuid(). Only its owning hart touches it, with
+// interrupts off, so no lock is needed. Aligned so harts don't share lines.
+struct kmem_pcp {
+    struct run *list;       // dirty pages
+    size_t count;
+    struct run *zlist;      // pre-zeroed pages taken from zero_pool
+    size_t zcount;
+    size_t alloc_ops;
+    size_t zero_hits;       // kalloc() served a pre-zeroed page
+    size_t zero_misses;     // kalloc() had to memset itself
+} __attribute__((aligned(64)));
+
+static struct kmem_pcp pcp[NCPU];
+
+#define PAGE_ALIGN_DOWN(x) ((uintptr_t)(x) & ~(PGSIZE - 1))
+#define PAGE_ALIGN_UP(x) (((uintptr_t)(x) + PGSIZE - 1) & ~(PGSIZE - 1))
+
+static inline int managed_pa(uintptr_t pa) {
+    return pa >= KERNBASE && pa < PHYSTOP;
+}
+
+// ---- buddy lists (caller holds kmem_lock) ----
+
+static void area_push(int order, size_t idx) {
+    struct run *r = (struct run *)FRAME2PA(idx);
+    struct free_area *fa = &free_area[order];
+    r->prev = NULL;
+    r->next = fa->head;
+    if (fa->head) fa->head->prev = r;
+    fa->head = r;
+    fa->nblocks++;
+    pages[idx].buddy = (uint8_t)(order + 1);
+}
 
+static void area_remove(int order, size_t idx) {
+    struct run *r = (struct run *)FRAME2PA(idx);
+    struct free_area *fa = &free_area[order];
+    if (r->prev) r->prev->next = r->next;
+    else fa->head = r->next;
+    if (r->next) r->next->prev = r->prev;
+    fa->nblocks--;
+    pages[idx].buddy = 0;
+}
+
+// put [a, end) on the buddy lists as the largest naturally aligned blocks
+// that fit.
+static void add_range(uintptr_t a, uintptr_t end) {
+    while (a < end) {
+        int order = KMEM_MAX_ORDER;
+        while (order > 0 &&
+               (((a - KERNBASE) & ((PGSIZE << order) - 1)) != 0 ||
+                a + (PGSIZE << order) > end))
+            order--;
 #ifdef KMEM_DEBUG
-static int freelist_contains(void *pa) {
-    struct run *r = freelist;
-    while (r) {
-        if ((void*)r == pa) return 1;
-        r = r->next;
+        memset((void*)a, 0xAB, PGSIZE << order);
+#endif
+        size_t idx = PA2FRAME(a);
+        for (size_t i = 0; i < ((size_t)1 << order); i++)
+            pages[idx + i].state = PG_FREE;
+        area_push(order, idx);
+        free_pages_count += (size_t)1 << order;
+        a += PGSIZE << order;
     }
-    return 0;
 }
-#endif
 
-#define PAGE_ALIGN_DOWN(x) ((uintptr_t)(x) & ~(PGSIZE - 1))
-#define PAGE_ALIGN_UP(x) (((uintptr_t)(x) + PGSIZE - 1) & ~(PGSIZE - 1))
+// bring the next chunk of deferred memory online. returns pages added.
+static size_t online_chunk(void) {
+    if (offline_start >= offline_end) return 0;
+    uintptr_t a = offline_start;
+    uintptr_t end = a + KMEM_ONLINE_CHUNK;
+    if (end > offline_end) end = offline_end;
+    offline_start = end;
+    add_range(a, end);
+    return (end - a) / PGSIZE;
+}
+
+// take one block of exactly `order`, splitting a larger block if needed.
+// onlines deferred memory when nothing large enough is free.
+static void *buddy_alloc(int order) {
+    int o;
+    for (;;) {
+        o = order;
+        while (o <= KMEM_MAX_ORDER && !free_area[o].head) o++;
+        if (o <= KMEM_MAX_ORDER) break;
+        if (online_chunk() == 0) return NULL;
+    }
+
+    size_t idx = PA2FRAME(free_area[o].head);
+    area_remove(o, idx);
+    // hand the upper halves back until the block is the requested size
+    while (o > order) {
+        o--;
+        area_push(o, idx + ((size_t)1 << o));
+    }
+    free_pages_count -= (size_t)1 << order;
+    return FRAME2PA(idx);
+}
+
+// return a block and merge it with its free buddy as far as possible.
+static void buddy_free(void *pa, int order) {
+    size_t idx = PA2FRAME(pa);
+    free_pages_count += (size_t)1 << order;
+    while (order < KMEM_MAX_ORDER) {
+        size_t buddy = idx ^ ((size_t)1 << order);
+        if (buddy >= KMEM_NFRAMES || pages[buddy].buddy != order + 1)
+            break;
+        area_remove(order, buddy);
+        if (buddy < idx) idx = buddy;
+        order++;
+    }
+    area_push(order, idx);
+}
+
+/* Optionally enable KMEM_DEBUG in your build to poison freed pages */
+// #define KMEM_DEBUG
+
+// ---- page frame database ----
+
+static void frame_panic(const char *who, void *pa, char *why) {
+    printf("%s: pa %p\n", who, pa);
+    panic(why);
+}
+
+// descriptor for pa; panics on pointers the allocator could never have
+// handed out (misaligned, outside RAM).
+static struct page *frame_lookup(void *pa, const char *who) {
+    if (((uintptr_t)pa & (PGSIZE - 1)) != 0 || !managed_pa(VA2PA(pa)))
+        frame_panic(who, pa, "foreign page");
+    return &pages[PA2FRAME(pa)];
+}
+
+// mark a block just taken off a free list as allocated with one reference.
+static void frames_alloc(void *pa, int order) {
+    size_t idx = PA2FRAME(pa);
+    for (size_t i = 1; i < ((size_t)1 << order); i++)
+        pages[idx + i].state = PG_TAIL;
+    pages[idx].order = (uint8_t)order;
+    pages[idx].refcnt = 1;
+    __atomic_store_n(&pages[idx].state, PG_ALLOC, __ATOMIC_RELEASE);
+}
+
+// drop one reference to an allocated block. returns 1 when that was the
+// last one and the frames are now PG_FREE (the caller must put the block on
+// a free list), 0 while other references remain.
+static int frames_release(void *pa, int order, const char *who) {
+    struct page *pg = frame_lookup(pa, who);
+    uint32_t st = __atomic_load_n(&pg->state, __ATOMIC_ACQUIRE);
+    if (st == PG_FREE)
+        frame_panic(who, pa, "double free");
+    if (st == PG_PINNED)
+        frame_panic(who, pa, "freeing pinned page");
+    if (st != PG_ALLOC && st != PG_PAGETABLE)
+        frame_panic(who, pa, "not an allocated block");
+    if (pg->order != order)
+        frame_panic(who, pa, "order mismatch");
+
+    if (__atomic_sub_fetch(&pg->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return 0;
+    // catches two harts racing to free the same last reference
+    if (__atomic_exchange_n(&pg->state, PG_FREE, __ATOMIC_ACQ_REL) == PG_FREE)
+        frame_panic(who, pa, "double free");
+    for (size_t i = 1; i < ((size_t)1 << order); i++)
+        pg[i].state = PG_FREE;
+    return 1;
+}
 
 void kinit(void *start, void *endpa) {
     KMEM_LOCK_INIT();
     uintptr_t a = PAGE_ALIGN_UP((uintptr_t)start);
     uintptr_t end = PAGE_ALIGN_DOWN((uintptr_t)endpa);
 
+    if (a < KERNBASE) a = KERNBASE;
+    if (end > PHYSTOP) end = PHYSTOP;
     if (a >= end) return;
 
+    // online only a small head of the range now; end it on a max-order
+    // boundary so later chunks carve into whole top-order blocks.
+    uintptr_t top = PGSIZE << KMEM_MAX_ORDER;
+    uintptr_t eager = a + KMEM_EAGER_BYTES;
+    eager = KERNBASE + (((eager - KERNBASE) + top - 1) & ~(top - 1));
+    if (eager > end) eager = end;
+
     KMEM_LOCK();
-    for (; a + PGSIZE <= end; a += PGSIZE) {
-        struct run *r = (struct run *)a;
-#ifdef KMEM_DEBUG
-        memset((void*)a, 0xAB, PGSIZE);
-#endif
-        r->next = freelist;
-        freelist = r;
-        free_pages_count++;
-        total_pages_count++;
+    total_pages_count += (end - a) / PGSIZE;
+    add_range(a, eager);
+    offline_start = eager;
+    offline_end = end;
+    KMEM_UNLOCK();
+}
+
+// idle-loop hook: bring one more deferred chunk online. returns pages added,
+// 0 once all memory is online.
+size_t kmem_online_idle(void) {
+    KMEM_LOCK();
+    size_t n = online_chunk();
+    KMEM_UNLOCK();
+    return n;
+}
+
+size_t kmem_offline_pages(void) {
+    size_t v;
+    KMEM_LOCK();
+    v = (offline_end - offline_start) / PGSIZE;
+    KMEM_UNLOCK();
+    return v;
+}
+
+// move up to KMEM_PCP_BATCH single pages from the buddy lists into c.
+// caller has interrupts off.
+static void pcp_refill(struct kmem_pcp *c) {
+    KMEM_LOCK();
+    for (int i = 0; i < KMEM_PCP_BATCH; i++) {
+        struct run *r = buddy_alloc(0);
+        if (!r) break;
+        r->next = c->list;
+        c->list = r;
+        c->count++;
+    }
+    KMEM_UNLOCK();
+}
+
+// give n pages from c back to the buddy lists with one lock round trip.
+static void pcp_drain(struct kmem_pcp *c, size_t n) {
+    if (n == 0 || !c->list) return;
+    KMEM_LOCK();
+    while (n-- > 0 && c->list) {
+        struct run *r = c->list;
+        c->list = r->next;
+        c->count--;
+        buddy_free(r, 0);
+    }
+    KMEM_UNLOCK();
+}
+
+// move up to KMEM_PCP_BATCH pre-zeroed pages from zero_pool into c.
+static void pcp_refill_zero(struct kmem_pcp *c) {
+    KMEM_LOCK();
+    for (int i = 0; i < KMEM_PCP_BATCH && zero_pool; i++) {
+        struct run *r = zero_pool;
+        zero_pool = r->next;
+        zero_pool_count--;
+        r->next = c->zlist;
+        c->zlist = r;
+        c->zcount++;
     }
     KMEM_UNLOCK();
 }
 
+// pop a page from c's zeroed / dirty list, refilling it first if empty.
+// caller has interrupts off.
+static struct run *pcp_pop_zero(struct kmem_pcp *c) {
+    // peek without the lock: while the pool is empty (at boot, before the
+    // idle loop has zeroed anything, or once it runs dry) kalloc() must not
+    // take kmem_lock on every call. a stale answer only costs one refill
+    // attempt or one page zeroed by hand.
+    if (!c->zlist && __atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) != 0)
+        pcp_refill_zero(c);
+    struct run *r = c->zlist;
+    if (r) {
+        c->zlist = r->next;
+        c->zcount--;
+    }
+    return r;
+}
+
+static struct run *pcp_pop_dirty(struct kmem_pcp *c) {
+    if (!c->list)
+        pcp_refill(c);
+    struct run *r = c->list;
+    if (r) {
+        c->list = r->next;
+        c->count--;
+    }
+    return r;
+}
+
 // return kernel-accessible page (VA) or NULL
 void *kalloc(void) {
-    KMEM_LOCK();
-    struct run *r = freelist;
+    int intr = intr_save();
+    struct kmem_pcp *c = &pcp[cpuid()];
+    struct run *r = pcp_pop_zero(c);
+    int zeroed = (r != NULL);
+    if (!r)
+        r = pcp_pop_dirty(c);
     if (r) {
-        freelist = r->next;
-        free_pages_count--;
-        alloc_ops++;
-        
-        // zero to avoid leaking data
-        // 必须在锁的保护下进行清零！
+        c->alloc_ops++;
+        if (zeroed) c->zero_hits++;
+        else c->zero_misses++;
+    }
+    intr_restore(intr);
+    if (r)
+        frames_alloc(r, 0);
+
+    // zero to avoid leaking data; the page is private to us now,
+    // so this no longer has to happen under kmem_lock.
+    if (r && !zeroed)
+        memset((void*)r, 0, PGSIZE);
+    else if (r)
+        r->next = NULL;   // the only word the pool linkage dirtied
+    return (void*)r;
+}
+
+// like kalloc(), but the contents are undefined. for callers that
+// overwrite the whole page anyway; prefers dirty pages so the zero pool
+// is saved for kalloc().
+void *kalloc_nozero(void) {
+    int intr = intr_save();
+    struct kmem_pcp *c = &pcp[cpuid()];
+    struct run *r = pcp_pop_dirty(c);
+    if (!r)
+        r = pcp_pop_zero(c);
+    if (r)
+        c->alloc_ops++;
+    intr_restore(intr);
+    if (r)
+        frames_alloc(r, 0);
+    return (void*)r;
+}
+
+// background zeroing: clear up to KMEM_ZERO_STEP dirty pages and park them
+// in zero_pool until it holds KMEM_ZERO_TARGET pages. runs with interrupts
+// on and without kmem_lock during the memset. returns pages zeroed, so an
+// idle loop can go to sleep once this returns 0.
+int kmem_zero_idle(void) {
+    int done = 0;
+    while (done < KMEM_ZERO_STEP) {
+        KMEM_LOCK();
+        int full = zero_pool_count >= KMEM_ZERO_TARGET;
+        struct run *r = full ? NULL : buddy_alloc(0);
+        KMEM_UNLOCK();
+        if (!r) break;
+
         memset((void*)r, 0, PGSIZE);
+
+        KMEM_LOCK();
+        r->next = zero_pool;
+        zero_pool = r;
+        zero_pool_count++;
+        KMEM_UNLOCK();
+        done++;
+    }
+    return done;
+}
+
+// give every pre-zeroed page back to the buddy lists so it can merge again.
+static void zero_pool_release(void) {
+    KMEM_LOCK();
+    while (zero_pool) {
+        struct run *r = zero_pool;
+        zero_pool = r->next;
+        zero_pool_count--;
+        buddy_free(r, 0);
     }
     KMEM_UNLOCK();
-    return (void*)r;
 }
 
+// drop one reference to a kalloc() page; the page goes back to the
+// allocator with the last one. panics on double free and foreign pointers.
 void kfree(void *pa) {
     if (!pa) return;
-
-    // must be page aligned
-    if (((uintptr_t)pa & (PGSIZE - 1)) != 0) {
-        // in debug, you may want to panic; here we just return
+    if (!frames_release(pa, 0, "kfree"))
         return;
-    }
 
 #ifdef KMEM_DEBUG
+    // write poison
+    memset(pa, 0xDB, PGSIZE);
+#endif
+
+    int intr = intr_save();
+    struct kmem_pcp *c = &pcp[cpuid()];
+    struct run *r = (struct run *)pa;
+    r->next = c->list;
+    c->list = r;
+    c->count++;
+    if (c->count > KMEM_PCP_HIGH)
+        pcp_drain(c, KMEM_PCP_BATCH);
+    intr_restore(intr);
+}
+
+// take a 2^order block from the buddy lists. if drain, a failure first
+// returns this hart's cached pages, the zero pool and empty slab pages to
+// the buddy lists (single pages parked there may be what blocks a merge)
+// and tries again.
+static void *pages_alloc(int order, int zero, int drain) {
+    if (order < 0 || order > KMEM_MAX_ORDER) return NULL;
+    if (order == 0) return zero ? kalloc() : kalloc_nozero();
+
     KMEM_LOCK();
-    if (freelist_contains(pa)) {
-        // double free detected - panic or log
-        // panic("kfree: double free");
+    void *p = buddy_alloc(order);
+    KMEM_UNLOCK();
+    if (!p && drain) {
+        kmem_slab_reclaim();
+        kmem_drain_local();
+        zero_pool_release();
+        KMEM_LOCK();
+        p = buddy_alloc(order);
         KMEM_UNLOCK();
+    }
+    if (p) {
+        int intr = intr_save();
+        pcp[cpuid()].alloc_ops++;
+        intr_restore(intr);
+        frames_alloc(p, order);
+        if (zero)
+            memset(p, 0, PGSIZE << order);
+    }
+    return p;
+}
+
+// allocate 2^order physically contiguous, naturally aligned pages (zeroed).
+void *kalloc_pages(int order) {
+    return pages_alloc(order, 1, 1);
+}
+
+// opportunistic kalloc_pages(): only what the buddy lists hold right now,
+// without draining the per-hart caches or the pre-zeroed pool, and zeroed
+// only if asked (a caller about to copy over the block passes zero = 0).
+// for callers with a fallback, such as transparent huge pages.
+void *kalloc_pages_try(int order, int zero) {
+    return pages_alloc(order, zero, 0);
+}
+
+// free a block obtained from kalloc_pages() with the same order.
+void kfree_pages(void *pa, int order) {
+    if (!pa || order < 0 || order > KMEM_MAX_ORDER) return;
+    if (order == 0) {
+        kfree(pa);
         return;
     }
+    if (((uintptr_t)pa & ((PGSIZE << order) - 1)) != 0)
+        frame_panic("kfree_pages", pa, "misaligned block");
+    if (!frames_release(pa, order, "kfree_pages"))
+        return;
+
+#ifdef KMEM_DEBUG
+    memset(pa, 0xDB, PGSIZE << order);
+#endif
+    KMEM_LOCK();
+    buddy_free(pa, order);
     KMEM_UNLOCK();
-    // write poison
-    memset(pa, 0xDB, PGSIZE);
+}
+
+// batch allocation shared by kalloc_batch() and kalloc_batch_nozero().
+// takes hart-local pages first (no lock), then the zero pool and buddy lists
+// in a single kmem_lock critical section. with zero set, pre-zeroed pages
+// are preferred and dirty ones are cleared afterwards, outside the lock.
+static int batch_alloc(int n, void **out, int zero) {
+    int got = 0;
+    int nzeroed = 0;     // out[0..nzeroed) came from a zeroed list
+    if (n <= 0) return 0;
+
+    int intr = intr_save();
+    struct kmem_pcp *c = &pcp[cpuid()];
+    struct run **first = zero ? &c->zlist : &c->list;
+    struct run **second = zero ? &c->list : &c->zlist;
+    size_t *first_count = zero ? &c->zcount : &c->count;
+    size_t *second_count = zero ? &c->count : &c->zcount;
+
+    while (got < n && *first) {
+        struct run *r = *first;
+        *first = r->next;
+        (*first_count)--;
+        out[got++] = r;
+    }
+    if (zero) nzeroed = got;
+
+    if (got < n) {
+        KMEM_LOCK();
+        if (zero) {
+            while (got < n && zero_pool) {
+                struct run *r = zero_pool;
+                zero_pool = r->next;
+                zero_pool_count--;
+                out[got++] = r;
+                nzeroed++;
+            }
+        }
+        while (got < n) {
+            struct run *r = buddy_alloc(0);
+            if (!r) break;
+            out[got++] = r;
+        }
+        KMEM_UNLOCK();
+    }
+    // last resort: whatever is left in the other local list
+    while (got < n && *second) {
+        struct run *r = *second;
+        *second = r->next;
+        (*second_count)--;
+        out[got++] = r;
+    }
+
+    c->alloc_ops += got;
+    if (zero) {
+        c->zero_hits += nzeroed;
+        c->zero_misses += got - nzeroed;
+    }
+    intr_restore(intr);
+
+    for (int i = 0; i < got; i++) {
+        frames_alloc(out[i], 0);
+        if (!zero)
+            continue;
+        if (i < nzeroed)
+            ((struct run *)out[i])->next = NULL;
+        else
+            memset(out[i], 0, PGSIZE);
+    }
+    return got;
+}
+
+// allocate up to n zeroed pages into out[] with at most one kmem_lock round
+// trip. returns how many were allocated (< n only when memory runs out).
+int kalloc_batch(int n, void **out) {
+    return batch_alloc(n, out, 1);
+}
+
+// kalloc_batch() for callers that overwrite every page.
+int kalloc_batch_nozero(int n, void **out) {
+    return batch_alloc(n, out, 0);
+}
+
+// drop one reference to each of n kalloc() pages; pages whose last
+// reference goes are returned with a single kmem_lock round trip.
+void kfree_batch(void **pa, int n) {
+    struct run *head = NULL;
+    int nfree = 0;
+    for (int i = 0; i < n; i++) {
+        if (!pa[i] || !frames_release(pa[i], 0, "kfree_batch"))
+            continue;
+#ifdef KMEM_DEBUG
+        memset(pa[i], 0xDB, PGSIZE);
 #endif
+        struct run *r = (struct run *)pa[i];
+        r->next = head;
+        head = r;
+        nfree++;
+    }
+    if (!head) return;
+
+    int intr = intr_save();
+    struct kmem_pcp *c = &pcp[cpuid()];
+    // top the local cache up to KMEM_PCP_HIGH, the rest goes to the buddy lists
+    while (head && c->count < KMEM_PCP_HIGH) {
+        struct run *r = head;
+        head = r->next;
+        r->next = c->list;
+        c->list = r;
+        c->count++;
+    }
+    if (head) {
+        KMEM_LOCK();
+        while (head) {
+            struct run *r = head;
+            head = r->next;
+            buddy_free(r, 0);
+        }
+        KMEM_UNLOCK();
+    }
+    intr_restore(intr);
+}
 
+// return every page cached by the calling hart to the buddy lists.
+void kmem_drain_local(void) {
+    int intr = intr_save();
+    struct kmem_pcp *c = &pcp[cpuid()];
+    pcp_drain(c, c->count);
     KMEM_LOCK();
-    struct run *r = (struct run *)pa;
-    r->next = freelist;
-    freelist = r;
-    free_pages_count++;
+    while (c->zlist) {
+        struct run *r = c->zlist;
+        c->zlist = r->next;
+        c->zcount--;
+        buddy_free(r, 0);
+    }
     KMEM_UNLOCK();
+    intr_restore(intr);
 }
 
 size_t kmem_total_pages(void) {
@@ -125,17 +680,139 @@ size_t kmem_total_pages(void) {
     KMEM_UNLOCK();
     return v;
 }
+// buddy lists, zero pool and not-yet-online memory, plus whatever the harts
+// hold in their caches. refill/drain update both sides under kmem_lock, so
+// pages in transit between a cache and the shared lists are never counted
+// twice or missed.
 size_t kmem_free_pages(void) {
     size_t v;
     KMEM_LOCK();
-    v = free_pages_count;
+    v = free_pages_count + zero_pool_count;
+    v += (offline_end - offline_start) / PGSIZE;
+    for (int i = 0; i < NCPU; i++) {
+        v += *(volatile size_t *)&pcp[i].count;
+        v += *(volatile size_t *)&pcp[i].zcount;
+    }
     KMEM_UNLOCK();
     return v;
 }
 size_t kmem_alloc_count(void) {
+    size_t v = 0;
+    for (int i = 0; i < NCPU; i++)
+        v += *(volatile size_t *)&pcp[i].alloc_ops;
+    return v;
+}
+
+size_t kmem_zero_hits(void) {
+    size_t v = 0;
+    for (int i = 0; i < NCPU; i++)
+        v += *(volatile size_t *)&pcp[i].zero_hits;
+    return v;
+}
+size_t kmem_zero_misses(void) {
+    size_t v = 0;
+    for (int i = 0; i < NCPU; i++)
+        v += *(volatile size_t *)&pcp[i].zero_misses;
+    return v;
+}
+size_t kmem_zero_pool_pages(void) {
+    size_t v;
+    KMEM_LOCK();
+    v = zero_pool_count;
+    for (int i = 0; i < NCPU; i++)
+        v += *(volatile size_t *)&pcp[i].zcount;
+    KMEM_UNLOCK();
+    return v;
+}
+
+// number of free blocks currently sitting on the order-k list.
+size_t kmem_free_blocks(int order) {
+    if (order < 0 || order > KMEM_MAX_ORDER) return 0;
     size_t v;
     KMEM_LOCK();
-    v = alloc_ops;
+    v = free_area[order].nblocks;
     KMEM_UNLOCK();
     return v;
 }
+
+// print the buddy free lists; a healthy heap has most pages in high orders.
+void kmem_print_orders(void) {
+    size_t nblocks[KMEM_MAX_ORDER + 1];
+    KMEM_LOCK();
+    for (int o = 0; o <= KMEM_MAX_ORDER; o++)
+        nblocks[o] = free_area[o].nblocks;
+    KMEM_UNLOCK();
+
+    printf("kmem: order  blocks  pages\n");
+    for (int o = 0; o <= KMEM_MAX_ORDER; o++) {
+        printf("kmem: %d  %llu  %llu\n", o,
+               (unsigned long long)nblocks[o],
+               (unsigned long long)(nblocks[o] << o));
+    }
+    printf("kmem: %llu / %llu pages free\n",
+           (unsigned long long)kmem_free_pages(),
+           (unsigned long long)kmem_total_pages());
+    printf("kmem: zero pool %llu pages, %llu hits, %llu misses\n",
+           (unsigned long long)kmem_zero_pool_pages(),
+           (unsigned long long)kmem_zero_hits(),
+           (unsigned long long)kmem_zero_misses());
+}
+
+// state of the frame holding pa (PG_*); PG_RESERVED outside managed RAM.
+int kmem_page_state(void *pa) {
+    if (!managed_pa(VA2PA(pa))) return PG_RESERVED;
+    return __atomic_load_n(&pages[PA2FRAME(pa)].state, __ATOMIC_ACQUIRE);
+}
+
+// retag an allocated block head as PG_ALLOC, PG_PAGETABLE or PG_PINNED.
+void kmem_page_set_state(void *pa, int state) {
+    struct page *pg = frame_lookup(pa, "kmem_page_set_state");
+    uint32_t st = __atomic_load_n(&pg->state, __ATOMIC_ACQUIRE);
+    if (st != PG_ALLOC && st != PG_PAGETABLE && st != PG_PINNED)
+        frame_panic("kmem_page_set_state", pa, "not an allocated block");
+    if (state != PG_ALLOC && state != PG_PAGETABLE && state != PG_PINNED)
+        panic("kmem_page_set_state: bad state");
+    __atomic_store_n(&pg->state, (uint32_t)state, __ATOMIC_RELEASE);
+}
+
+// take an extra reference to an allocated block; returns the new count.
+int kmem_page_get(void *pa) {
+    struct page *pg = frame_lookup(pa, "kmem_page_get");
+    uint32_t st = __atomic_load_n(&pg->state, __ATOMIC_ACQUIRE);
+    if (st != PG_ALLOC && st != PG_PAGETABLE && st != PG_PINNED)
+        frame_panic("kmem_page_get", pa, "not an allocated block");
+    return (int)__atomic_add_fetch(&pg->refcnt, 1, __ATOMIC_ACQ_REL);
+}
+
+int kmem_page_refcnt(void *pa) {
+    struct page *pg = frame_lookup(pa, "kmem_page_refcnt");
+    return (int)__atomic_load_n(&pg->refcnt, __ATOMIC_ACQUIRE);
+}
+
+// order of the allocated block headed by pa, as passed to kalloc_pages().
+int kmem_page_order(void *pa) {
+    struct page *pg = frame_lookup(pa, "kmem_page_order");
+    uint32_t st = __atomic_load_n(&pg->state, __ATOMIC_ACQUIRE);
+    if (st != PG_ALLOC && st != PG_PAGETABLE && st != PG_PINNED)
+        frame_panic("kmem_page_order", pa, "not an allocated block");
+    return pg->order;
+}
+
+// turn an allocated block of `order` into 2^order independent order-0
+// blocks, each inheriting the head's state and reference count. used when
+// a superpage mapping is broken up and its pages are freed one by one.
+void kmem_split_pages(void *pa, int order) {
+    struct page *pg = frame_lookup(pa, "kmem_split_pages");
+    uint32_t st = __atomic_load_n(&pg->state, __ATOMIC_ACQUIRE);
+    if (st != PG_ALLOC && st != PG_PAGETABLE && st != PG_PINNED)
+        frame_panic("kmem_split_pages", pa, "not an allocated block");
+    if (pg->order != order)
+        frame_panic("kmem_split_pages", pa, "order mismatch");
+    uint32_t ref = __atomic_load_n(&pg->refcnt, __ATOMIC_ACQUIRE);
+    for (size_t i = 1; i < ((size_t)1 << order); i++) {
+        pg[i].order = 0;
+        pg[i].refcnt = ref;
+        __atomic_store_n(&pg[i].state, st, __ATOMIC_RELEASE);
+    }
+    pg->order = 0;
+}
@@ -5,12 +5,58 @@
 #include <stddef.h>
 #include <stdint.h>
 
-void kinit(void *start, void *endpa); // start/end are kernel-accessible addresses (VA)
+// largest buddy block is 2^KMEM_MAX_ORDER pages (order 9 = one 2 MiB superpage)
+#define KMEM_MAX_ORDER 10
+
+// page frame states (kmem_page_state)
+#define PG_RESERVED  0   // not managed: kernel image, offline memory, MMIO
+#define PG_FREE      1
+#define PG_ALLOC     2
+#define PG_PAGETABLE 3
+#define PG_PINNED    4   // must not be freed until unpinned (e.g. DMA)
+#define PG_TAIL      5   // non-head frame of a kalloc_pages() block
+
+void kinit(void *start, void *endpa); // start/end are kernel-accessible addresses (VA); onlines a small head eagerly
 void *kalloc(void);                    // return a kernel-accessible page (VA) or NULL
-void kfree(void *pa);                  // pa is the pointer returned by kalloc (VA)
+void *kalloc_nozero(void);             // like kalloc() but contents undefined (caller overwrites)
+void kfree(void *pa);                  // drop a reference to a kalloc() page; frees on the last
+int kalloc_batch(int n, void **out);   // up to n zeroed pages, one lock round trip; returns count
+int kalloc_batch_nozero(int n, void **out);
+void kfree_batch(void **pa, int n);    // kfree() n pages, one lock round trip
+void *kalloc_pages(int order);         // 2^order contiguous, size-aligned pages (VA) or NULL
+void *kalloc_pages_try(int order, int zero); // no cache drain on failure; zeroed only if asked
+void kfree_pages(void *pa, int order); // free a kalloc_pages() block; order must match
+void kmem_drain_local(void);           // flush this hart's page cache back to the buddy lists
+int kmem_zero_idle(void);              // idle-loop hook: pre-zero a few pages, returns count
+size_t kmem_online_idle(void);         // idle-loop hook: online one deferred chunk, returns pages
+
+int kmem_page_state(void *pa);               // PG_* of the frame holding pa
+void kmem_page_set_state(void *pa, int state); // retag an allocated block (ALLOC/PAGETABLE/PINNED)
+int kmem_page_get(void *pa);                 // add a reference, returns the new count
+int kmem_page_refcnt(void *pa);
+int kmem_page_order(void *pa);               // order of an allocated block head
+void kmem_split_pages(void *pa, int order);  // allocated block -> 2^order single pages
 
 size_t kmem_total_pages(void);
 size_t kmem_free_pages(void);
 size_t kmem_alloc_count(void);
+size_t kmem_offline_pages(void);       // managed pages not yet on the buddy lists
+size_t kmem_zero_hits(void);           // kalloc() calls served from the pre-zeroed pool
+size_t kmem_zero_misses(void);         // kalloc() calls that had to memset
+size_t kmem_zero_pool_pages(void);
+size_t kmem_free_blocks(int order);    // free blocks on the order-k buddy list
+void kmem_print_orders(void);          // dump per-order free lists (fragmentation)
+
+// slab.c - sub-page objects (16..1024 byte classes). larger sizes get a
+// kalloc_pages() block of the smallest order that fits, page-aligned, with
+// the order kept in the frame database, so kmalloc(PGSIZE) costs one page.
+void *kmalloc(size_t size);            // uninitialized object or NULL
+void *kzalloc(size_t size);            // zeroed object or NULL
+void kfree_obj(void *obj);             // free a kmalloc()/kzalloc() object
+
+size_t kmem_slab_alloc_count(void);
+size_t kmem_slab_pages(void);          // pages currently owned by slabs
+size_t kmem_slab_reclaim(void);        // flush this hart's caches, free empty slabs
+void kmem_print_slabs(void);
 
 #endif // KMEM_H
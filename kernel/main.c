@@ -5,11 +5,16 @@
 #include "riscv.h"
 #include "defs.h"
 #include "kmem.h"
+#include "vm.h"
+#include "swap.h"
+#include "timer.h"
+#include "wheel.h"
+#include "softirq.h"
 
 extern char end[]; // 从链接器脚本获取
 
-// 引用来自 trap.c 的全局测试计数器
-extern volatile int timer_test_interrupt_count;
+// 时钟中断测试的计数器
+volatile int timer_test_interrupt_count = 0;
 
 // 函数原型
 void test_timer_interrupt(void);
@@ -20,7 +25,24 @@ void main(void) {
     printf("booting helloos...\n");
     
     // 初始化物理内存分配器
+    // kinit 只立即上线一小段内存，其余部分在空闲循环或按需分块上线
+    uint64 kinit_start = r_time();
     kinit((void*)end, (void*)PHYSTOP);
+    uint64 kinit_ticks = r_time() - kinit_start;
+    printf("kinit: %llu ticks, %llu pages online, %llu deferred\n",
+           kinit_ticks,
+           (unsigned long long)(kmem_free_pages() - kmem_offline_pages()),
+           (unsigned long long)kmem_offline_pages());
+
+    // 建立内核页表（尽量使用 2MB/1GB 大页）并开启 Sv39 分页
+    uint64 kvm_start = r_time();
+    kvminit();
+    printf("kvminit: %llu ticks, %llu page-table pages\n",
+           r_time() - kvm_start, (unsigned long long)vm_pagetable_pages());
+    kvminithart();
+
+    // 换页区：VIRTIO0 上的块设备（没有的话不换页）
+    swapinit();
     
     // 初始化中断控制器
     plicinit();
@@ -28,6 +50,9 @@ void main(void) {
 
     // 初始化S模式的中断向量
     trapinithart();
+    // 本核的定时器队列（空的，所以暂时不会有时钟中断）和超时用的时间轮
+    timerinithart();
+    wheelinithart();
     
     // 开启 supervisor 模式的中断
     intr_on();
@@ -35,11 +60,47 @@ void main(void) {
     printf("setup complete; waiting for interrupts.\n");
     // 调用时钟中断测试函数
     test_timer_interrupt();
+    // 性能测试
+    bench_kalloc_batch();
+    bench_slab();
+    bench_kvm_superpage();
+    bench_cow_fork();
+    bench_lazy_alloc();
+    bench_vm_remap();
+    bench_tlb_asid();
+    bench_swap();
+    bench_trap_paths();
+    bench_plic();
+    bench_timer_wheel();
     //timer_test_interrupt_count = 0;
     printf("\nAll tests passed!\nSystem halting.\n");
-    // 等待中断发生
-    while(1){};
+    // 等待中断发生；空闲时先跑完中断返回时超出预算剩下的下半部，
+    // 再顺便在后台上线剩余内存、为 kalloc() 预先清零空闲页，
+    // 空闲内存低于水位线时把用户页换出
+    while(1){
+      if(softirq_idle() == 0 && kmem_online_idle() == 0 && kmem_zero_idle() == 0 &&
+         vm_reclaim_idle() == 0)
+        asm volatile("wfi");
+    }
+}
+#define TEST_TIMER_PERIOD (TIMER_HZ / 10)   // 0.1 秒
+
+static struct timer test_timer;
+static uint64 test_timer_late;              // 回调比 deadline 晚了多少（最大值）
+
+// 测试用的定时器回调：计数、打印，再把自己挂回去，凑成一个周期定时器
+static void
+test_timer_tick(void *arg)
+{
+  uint64 late = r_time() - test_timer.deadline;
+  if(late > test_timer_late)
+    test_timer_late = late;
+  timer_test_interrupt_count++;
+  printf("tick%d", timer_test_interrupt_count);
+  if(timer_test_interrupt_count < 6)
+    timer_add(&test_timer, test_timer.deadline + TEST_TIMER_PERIOD, test_timer_tick, 0);
 }
+
 // 时钟中断功能测试
 //
 void test_timer_interrupt(void) {
@@ -48,22 +109,23 @@ void test_timer_interrupt(void) {
     // 记录测试前的时间
     uint64 start_time = r_time();
     // --- 启动测试 ---
-    // 将全局测试计数器设置为 1，"激活" clockintr 中的计数逻辑
+    // 将全局测试计数器设置为 1，挂上第一个定时器；之后回调每次把自己再挂回去
     timer_test_interrupt_count = 1;
-    // 等待，直到 clockintr 将计数器增加到 6 (表示已经发生了 5 次有效中断)
+    timer_add(&test_timer, start_time + TEST_TIMER_PERIOD, test_timer_tick, 0);
+    // 等待，直到回调将计数器增加到 6 (表示已经发生了 5 次有效中断)
     while (timer_test_interrupt_count < 6) {
       // 可以在这里执行其他任务，模拟一个忙碌的 CPU
       // 我们用一个简单的延时循环来模拟
       
     }
     // --- 停止测试 ---
-    // 将测试计数器设置回 0，让 clockintr 停止计数和打印
+    // 将测试计数器设置回 0。定时器已经不再挂回去，队列空了以后
+    // 这个核就不会再收到时钟中断
     timer_test_interrupt_count = 0;
 
-    // --- 可选：关闭时钟中断，让系统彻底安静下来 ---
-    //w_sie(r_sie() & ~SIE_STIE);
-
     uint64 end_time = r_time();
 
-    printf("\nTimer test completed: 5 interrupts occurred in %llu clock cycles.\n", end_time - start_time);
+    printf("\nTimer test completed: 5 interrupts occurred in %llu clock cycles, at most %llu late.\n",
+           end_time - start_time, test_timer_late);
+    timer_print_stats();
 }
\ No newline at end of file
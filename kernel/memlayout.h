@@ -7,6 +7,11 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
+// PLIC priorities (see plic.c): a hart whose threshold is PLIC_PRIO_BULK
+// still takes the UART but no longer the disk
+#define PLIC_PRIO_BULK 1
+#define PLIC_PRIO_INTERACTIVE 2
+
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -29,8 +34,13 @@
 // each surrounded by invalid guard pages.
 //#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
+// lowest user virtual address. the kernel identity map (devices below
+// 1GB, RAM from KERNBASE) lives in root page-table slots 0 and 2 of every
+// address space, so user memory cannot use [0, 1GB) or [2GB, 3GB).
+#define USERBASE 0x40000000L
+
 // User memory layout.
-// Address zero first:
+// Address USERBASE first:
 //   text
 //   original data and bss
 //   fixed-size stack
@@ -1,47 +1,306 @@
 // kernel/plic.c
-
+// PLIC：每个核一个 S 模式上下文（使能位、优先级阈值、claim/complete），
+// 按 tp 里的核号访问。每个中断同一时刻只发给一个核（亲和性），
+// 可以用 plic_set_affinity() 手动指定，也可以打开均衡器，
+// 按各中断处理函数实际花的时间把它们分摊到各个核上。
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
 #include "riscv.h"
+#include "spinlock.h"
 #include "defs.h"
+#include "wheel.h"
+
+#define PLIC_NIRQ 32                  // 只用第一个使能字：中断号 0..31
+#define PLIC_BALANCE_PERIOD (TIMER_HZ / 10)  // 均衡器每 0.1 秒看一次
+
+// 我们管理的中断
+static const int plic_irqs[] = { UART0_IRQ, VIRTIO0_IRQ };
+#define PLIC_NMANAGED (sizeof(plic_irqs) / sizeof(plic_irqs[0]))
+
+struct plic_irq {
+  int hart;                           // 发给哪个核
+  int prio;
+  uint64 count;                       // 处理过的次数
+  uint64 cycles;                      // claim 到 complete 的总周期数
+  uint64 balanced;                    // 上次均衡时的 cycles
+  uint64 moves;                       // 被均衡器挪动的次数
+};
+
+static struct {
+  struct spinlock lock;               // 保护 hart/prio/threshold 和使能寄存器
+  struct plic_irq irq[PLIC_NIRQ];
+  int threshold[NCPU];
+  uint64 online;                      // 调用过 plicinithart() 的核
+  int balancing;
+  uint64 balance_runs;                // 均衡器看过几次
+  struct wtimer balance_timer;
+} plic;
+
+// 每个核最近一次 claim 的时刻，complete 时算出处理时间
+static uint64 claim_at[NCPU];
+
+static void plic_balance_tick(void *arg);
+
+static inline volatile uint32 *
+senable(int hart)
+{
+  return (volatile uint32 *)PLIC_SENABLE(hart);
+}
 
 void
 plicinit(void)
 {
-  // 为UART和virtio磁盘中断设置一个非零的优先级 (否则它们会被禁用)
-  *(uint32*)(PLIC + UART0_IRQ * 4) = 1;
-  *(uint32*)(PLIC + VIRTIO0_IRQ * 4) = 1;
+  initlock(&plic.lock, "plic");
+  // 为UART和virtio磁盘中断设置一个非零的优先级 (否则它们会被禁用)。
+  // 串口比磁盘高一级，核可以用阈值 PLIC_PRIO_BULK 只屏蔽磁盘
+  plic.irq[UART0_IRQ].prio = PLIC_PRIO_INTERACTIVE;
+  plic.irq[VIRTIO0_IRQ].prio = PLIC_PRIO_BULK;
+  for(int i = 0; i < PLIC_NMANAGED; i++){
+    int irq = plic_irqs[i];
+    plic.irq[irq].hart = 0;           // 先都发给启动核
+    *(volatile uint32 *)(PLIC_PRIORITY + irq * 4) = plic.irq[irq].prio;
+  }
 }
 
+// 打开本核的 PLIC 上下文：使能亲和性指向本核的中断，设置阈值
 void
 plicinithart(void)
 {
-  // 我们的内核目前是单核运行，所以 hart id 总是 0.
-  // 我们将 cpuid() 调用替换为硬编码的 0.
-  int hart = 0; 
-  
-  // 为这个核心的 Supervisor mode 开启 UART 和 virtio 磁盘中断
-  *(uint32*)PLIC_SENABLE(hart) = (1 << UART0_IRQ) | (1 << VIRTIO0_IRQ);
+  int hart = cpuid();
+  int intr = intr_save();
+  acquire(&plic.lock);
+  uint32 en = 0;
+  for(int i = 0; i < PLIC_NMANAGED; i++)
+    if(plic.irq[plic_irqs[i]].hart == hart)
+      en |= 1U << plic_irqs[i];
+  *senable(hart) = en;
+  // 阈值默认 0：任何优先级 > 0 的中断都会被处理
+  *(volatile uint32 *)PLIC_SPRIORITY(hart) = plic.threshold[hart];
+  plic.online |= 1UL << hart;
+  release(&plic.lock);
+  intr_restore(intr);
+}
+
+// 把 irq 从原来的核挪到 hart。持有 plic.lock
+static void
+move_irq(int irq, int hart)
+{
+  int old = plic.irq[irq].hart;
+  if(old == hart)
+    return;
+  // 先在新核上打开再在旧核上关掉：中间最多两个核都能收到，
+  // claim 保证只有一个拿到，不会丢
+  if(plic.online & (1UL << hart))
+    *senable(hart) |= 1U << irq;
+  plic.irq[irq].hart = hart;
+  if(plic.online & (1UL << old))
+    *senable(old) &= ~(1U << irq);
+}
+
+static int
+managed(int irq)
+{
+  for(int i = 0; i < PLIC_NMANAGED; i++)
+    if(plic_irqs[i] == irq)
+      return 1;
+  return 0;
+}
+
+// hart 在线，阈值也放得过 irq。持有 plic.lock
+static int
+eligible(int irq, int hart)
+{
+  return (plic.online & (1UL << hart)) && plic.irq[irq].prio > plic.threshold[hart];
+}
+
+// 让 irq 只发给 hart。hart 必须已经 plicinithart()。成功返回 0
+int
+plic_set_affinity(int irq, int hart)
+{
+  if(irq <= 0 || irq >= PLIC_NIRQ || !managed(irq) || hart < 0 || hart >= NCPU)
+    return -1;
+  int intr = intr_save();
+  acquire(&plic.lock);
+  int ok = (plic.online & (1UL << hart)) != 0;
+  if(ok)
+    move_irq(irq, hart);
+  release(&plic.lock);
+  intr_restore(intr);
+  return ok ? 0 : -1;
+}
+
+int
+plic_get_affinity(int irq)
+{
+  if(irq <= 0 || irq >= PLIC_NIRQ || !managed(irq))
+    return -1;
+  return plic.irq[irq].hart;
+}
 
-  // 设置这个核心的 Supervisor mode 中断优先级阈值为 0
-  // (任何优先级 > 0 的中断都会被处理)
-  *(uint32*)PLIC_SPRIORITY(hart) = 0;
+// 设置 hart 的优先级阈值：优先级 <= threshold 的中断不再发给它。
+// 对延迟敏感的核设成 PLIC_PRIO_BULK 就收不到磁盘中断了；
+// 原来发给它、现在被屏蔽的中断挪到别的放得过的核上（没有就留着）
+void
+plic_set_threshold(int hart, int threshold)
+{
+  if(hart < 0 || hart >= NCPU)
+    return;
+  int intr = intr_save();
+  acquire(&plic.lock);
+  plic.threshold[hart] = threshold;
+  if(plic.online & (1UL << hart))
+    *(volatile uint32 *)PLIC_SPRIORITY(hart) = threshold;
+  for(int i = 0; i < PLIC_NMANAGED; i++){
+    int irq = plic_irqs[i];
+    if(plic.irq[irq].hart != hart || eligible(irq, hart))
+      continue;
+    for(int h = 0; h < NCPU; h++){
+      if(eligible(irq, h)){
+        move_irq(irq, h);
+        break;
+      }
+    }
+  }
+  release(&plic.lock);
+  intr_restore(intr);
 }
 
 // 查询 PLIC，是哪个设备触发了中断
 int
 plic_claim(void)
 {
-  int hart = 0;
-  int irq = *(uint32*)PLIC_SCLAIM(hart);
+  int hart = cpuid();
+  int irq = *(volatile uint32 *)PLIC_SCLAIM(hart);
+  claim_at[hart] = r_cycle();
   return irq;
 }
 
-// 通知 PLIC，我们已经处理完这个中断了
+// 通知 PLIC，我们已经处理完这个中断了。顺便记下处理时间给均衡器用；
+// 同一个中断同一时刻只在一个核上处理，计数不需要锁
 void
 plic_complete(int irq)
 {
-  int hart = 0;
-  *(uint32*)PLIC_SCLAIM(hart) = irq;
-}
\ No newline at end of file
+  int hart = cpuid();
+  if(irq > 0 && irq < PLIC_NIRQ){
+    plic.irq[irq].count++;
+    plic.irq[irq].cycles += r_cycle() - claim_at[hart];
+  }
+  *(volatile uint32 *)PLIC_SCLAIM(hart) = irq;
+}
+
+// 按上一个周期里各中断花的时间重新分配：从最重的开始，每个放到
+// 当前负载最轻、阈值允许的在线核上。新分配的最大核负载比现在
+// 至少低 1/8 才真的挪，免得来回抖动。持有 plic.lock
+static void
+rebalance(void)
+{
+  uint64 load[PLIC_NMANAGED];
+  uint64 cur[NCPU] = { 0 }, next[NCPU] = { 0 };
+  int order[PLIC_NMANAGED], target[PLIC_NMANAGED];
+
+  for(int i = 0; i < PLIC_NMANAGED; i++){
+    struct plic_irq *p = &plic.irq[plic_irqs[i]];
+    load[i] = p->cycles - p->balanced;
+    p->balanced = p->cycles;
+    cur[p->hart] += load[i];
+    order[i] = i;
+  }
+  // 按负载从大到小排（只有几个中断，插入排序就够了）
+  for(int i = 1; i < PLIC_NMANAGED; i++)
+    for(int j = i; j > 0 && load[order[j]] > load[order[j - 1]]; j--){
+      int t = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = t;
+    }
+  for(int k = 0; k < PLIC_NMANAGED; k++){
+    int i = order[k];
+    int irq = plic_irqs[i];
+    int best = -1;
+    for(int h = 0; h < NCPU; h++){
+      if(!eligible(irq, h))
+        continue;
+      if(best < 0 || next[h] < next[best] ||
+         (next[h] == next[best] && h == plic.irq[irq].hart))
+        best = h;
+    }
+    if(best < 0)
+      best = plic.irq[irq].hart;
+    target[i] = best;
+    next[best] += load[i];
+  }
+
+  uint64 curmax = 0, nextmax = 0;
+  for(int h = 0; h < NCPU; h++){
+    if(cur[h] > curmax)
+      curmax = cur[h];
+    if(next[h] > nextmax)
+      nextmax = next[h];
+  }
+  if(nextmax + curmax / 8 >= curmax)
+    return;
+  for(int i = 0; i < PLIC_NMANAGED; i++){
+    if(target[i] != plic.irq[plic_irqs[i]].hart){
+      move_irq(plic_irqs[i], target[i]);
+      plic.irq[plic_irqs[i]].moves++;
+    }
+  }
+}
+
+// 均衡器的定时器回调（softirq 里，开着中断）
+static void
+plic_balance_tick(void *arg)
+{
+  int intr = intr_save();
+  acquire(&plic.lock);
+  int on = plic.balancing;
+  if(on){
+    rebalance();
+    plic.balance_runs++;
+  }
+  release(&plic.lock);
+  intr_restore(intr);
+  if(on)
+    wtimer_add(&plic.balance_timer, r_time() + PLIC_BALANCE_PERIOD, plic_balance_tick, 0);
+}
+
+// 打开/关闭中断均衡器。关掉后各中断停在当时的核上
+void
+plic_balancer(int on)
+{
+  int intr = intr_save();
+  acquire(&plic.lock);
+  int was = plic.balancing;
+  plic.balancing = on;
+  if(on && !was){
+    for(int i = 0; i < PLIC_NMANAGED; i++)
+      plic.irq[plic_irqs[i]].balanced = plic.irq[plic_irqs[i]].cycles;
+  }
+  release(&plic.lock);
+  intr_restore(intr);
+  if(on && !was)
+    wtimer_add(&plic.balance_timer, r_time() + PLIC_BALANCE_PERIOD, plic_balance_tick, 0);
+  else if(!on)
+    wtimer_cancel(&plic.balance_timer);
+}
+
+uint64
+plic_balance_runs(void)
+{
+  return plic.balance_runs;
+}
+
+void
+plic_print_stats(void)
+{
+  printf("plic: balancer %s, %llu runs\n", plic.balancing ? "on" : "off", plic.balance_runs);
+  for(int i = 0; i < PLIC_NMANAGED; i++){
+    struct plic_irq *p = &plic.irq[plic_irqs[i]];
+    printf("plic: irq %d prio %d -> hart %d, %llu handled, %llu cycles avg, %llu moves\n",
+           plic_irqs[i], p->prio, p->hart, p->count,
+           p->count ? p->cycles / p->count : 0, p->moves);
+  }
+  for(int h = 0; h < NCPU; h++)
+    if(plic.online & (1UL << h))
+      printf("plic: hart %d threshold %d\n", h, plic.threshold[h]);
+}
@@ -164,8 +164,12 @@ void printf_color(int color, const char *fmt, ...) {
     printf("\033[0m");
 }
 
+// panic 之后串口改成同步输出（见 uartputc()）
+volatile int panicked = 0;
+
 void panic(char *s)
 {
+  panicked = 1;
   printf("panic: %s\n", s);
   for(;;)
     ;
@@ -20,6 +20,9 @@ typedef uint64_t pte_t;
 #define PTE_G (1UL << 5)
 #define PTE_A (1UL << 6)
 #define PTE_D (1UL << 7)
+// bits 8-9 (RSW) are ignored by hardware and free for software use
+#define PTE_COW (1UL << 8)   // read-only because shared copy-on-write
+#define PTE_SWAP (1UL << 9)  // with PTE_V clear: swapped out (see swap.h)
 
 // Sv39 specifics: 9 bits per level
 static inline uint64_t vpn_index(uint64_t va, int level) {
@@ -53,6 +56,24 @@ static inline void sfence_vma(void) {
     asm volatile("sfence.vma" ::: "memory");
 }
 
+// flush every non-global entry tagged with asid (leaf and non-leaf)
+static inline void sfence_vma_asid(uint64_t asid) {
+    asm volatile("sfence.vma zero, %0" :: "r"(asid) : "memory");
+}
+
+// flush the leaf entries for one page in every address space, global
+// mappings included
+static inline void sfence_vma_va(uint64_t va) {
+    asm volatile("sfence.vma %0, zero" :: "r"(va) : "memory");
+}
+
+// flush the leaf entry for one page of one address space. page-table
+// (non-leaf) entries are not covered: use sfence_vma_asid() after
+// unlinking a table.
+static inline void sfence_vma_page(uint64_t va, uint64_t asid) {
+    asm volatile("sfence.vma %0, %1" :: "r"(va), "r"(asid) : "memory");
+}
+
 
 //------------------------------------
 // ---------- 核心与权限状态 -----------
@@ -91,6 +112,7 @@ w_mstatus(uint64 x)
   asm volatile("csrw mstatus, %0" : : "r" (x));
 }
 //定义了 sstatus 寄存器中单个控制位的位置。
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User pages
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -124,6 +146,22 @@ w_mepc(uint64 x)
   asm volatile("csrw mepc, %0" : : "r" (x));
 }
 
+// 读/写 sscratch 寄存器。硬件不使用它，留给 trap 入口当临时寄存器：
+// 我们让它指向本核中断栈的栈顶，已经在中断栈上时为 0。
+static inline void
+w_sscratch(uint64 x)
+{
+  asm volatile("csrw sscratch, %0" : : "r" (x));
+}
+
+static inline uint64
+r_sscratch()
+{
+  uint64 x;
+  asm volatile("csrr %0, sscratch" : "=r" (x) );
+  return x;
+}
+
 // 读/写 sepc (Supervisor Exception Program Counter) 寄存器。
 // 与 mepc 类似，它存放的是 S-mode trap 处理完毕后，sret 指令应该返回到的地址。
 // 当发生中断时，CPU 会自动将被中断的指令地址存入 sepc。
@@ -217,11 +255,13 @@ w_sip(uint64 x)
 {
   asm volatile("csrw sip, %0" : : "r" (x));
 }
+#define SIP_SSIP (1L << 1) // software interrupt pending（S-mode 自己可以置位/清除）
 
 //读/写 sie (Supervisor Interrupt Enable) 寄存器。
 //这是一个中断使能掩码，用来分别控制是否允许 S-mode 响应外部中断 (SEIE)、时钟中断 (STIE) 等。
 #define SIE_SEIE (1L << 9) // external
 #define SIE_STIE (1L << 5) // timer
+#define SIE_SSIE (1L << 1) // software
 static inline uint64
 r_sie()
 {
@@ -276,6 +316,24 @@ intr_get()
   return (x & SSTATUS_SIE) != 0;
 }
 
+// 关闭中断并返回之前的中断状态，配合 intr_restore() 使用。
+// 用于保护每个核心私有的数据结构（例如 per-hart 缓存），
+// 防止同一核心上的中断处理函数重入。
+static inline int
+intr_save()
+{
+  int old = intr_get();
+  intr_off();
+  return old;
+}
+
+static inline void
+intr_restore(int old)
+{
+  if(old)
+    intr_on();
+}
+
 //------------------------------------
 // ----------- 时钟与计数器 ------------
 //------------------------------------
@@ -290,6 +348,17 @@ r_time()
   return x;
 }
 
+//读取 cycle 寄存器，即当前核心执行过的时钟周期数。
+//S-mode 能否读取它由 mcounteren 的 CY 位决定（在 start.c 的 timerinit 中打开）。
+//适合用来给一小段代码计时（性能测试）。
+static inline uint64
+r_cycle()
+{
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
 //读/写 stimecmp寄存器。这是一个由 S-mode 控制的“闹钟”。
 //我们在 timerinit 和 kerneltrap 中向它写入一个未来的 time 值。
 //当 time 寄存器的值增长到大于等于 stimecmp 的值时，就会触发一次 S-mode 时钟中断。
@@ -360,8 +429,11 @@ w_pmpaddr0(uint64 x)
 {
   asm volatile("csrw pmpaddr0, %0" : : "r" (x));
 }
-//读/写 stvec寄存器。它存放着 S-mode 的统一 trap 处理入口函数的地址。
-//我们在 trapinithart 中把我们写的汇编函数 kernelvec 的地址写入它。
+//读/写 stvec寄存器。它存放着 S-mode 的 trap 处理入口地址，最低两位是模式：
+//直接模式下所有 trap 都进 BASE；向量模式下异常进 BASE，
+//中断进 BASE + 4 * 中断号。我们在 trapinithart 中设置它。
+#define STVEC_MODE_DIRECT   0
+#define STVEC_MODE_VECTORED 1
 static inline void 
 w_stvec(uint64 x)
 {
@@ -379,6 +451,11 @@ r_stvec()
 #define SATP_SV39 (8L << 60)//Sv39 分页模式在 satp 寄存器中的编码值。
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+// satp[59:44] 是 ASID：TLB 表项按 ASID 打标签，切换地址空间时不必整体刷新
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xFFFFUL
+#define MAKE_SATP_ASID(pagetable, asid) \
+  (MAKE_SATP(pagetable) | (((uint64)(asid) & SATP_ASID_MASK) << SATP_ASID_SHIFT))
 
 //读/写 satp (Supervisor Address Translation and Protection) 寄存器。
 //这是开启分页机制的核心。它包含了根页表的物理地址和地址转换模式（如 Sv39）。
@@ -426,6 +503,13 @@ w_tp(uint64 x)
   asm volatile("mv tp, %0" : : "r" (x));
 }
 
+// 当前核心的 hart id（由 start.c 保存在 tp 寄存器中）。
+static inline int
+cpuid()
+{
+  return (int)r_tp();
+}
+
 static inline uint64
 r_ra()
 {
@@ -0,0 +1,294 @@
+// slab.c - size-class object allocator on top of kalloc()
+//
+// Objects up to SLAB_MAX_SIZE bytes come from one-page slabs, one slab list
+// per power-of-two size class. Every slab page starts with a struct slab
+// header, so kfree_obj() finds the owner by rounding the pointer down.
+// Each hart keeps a small magazine of free objects per class, so most
+// kmalloc()/kfree_obj() calls take no lock. Larger requests fall through
+// to kalloc_pages() and carry no header: the block order lives in the page
+// frame database, and a page-aligned pointer can only be such a block
+// (slab objects start after the header).
+#include "kmem.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SLAB_MIN_SHIFT 4                        // 16 bytes
+#define SLAB_NCLASS 7                           // 16 .. 1024 bytes
+#define SLAB_MAX_SIZE (1UL << (SLAB_MIN_SHIFT + SLAB_NCLASS - 1))
+#define SLAB_HDR 64                             // header area at start of a slab page
+#define SLAB_MAG 16                             // per-hart magazine slots per class
+#define SLAB_KEEP_EMPTY 1                       // empty slabs kept per class before reclaim
+
+#define SLAB_MAGIC  0x51ab51abU
+
+#define PAGE_ALIGN_DOWN(x) ((uintptr_t)(x) & ~(PGSIZE - 1))
+
+struct slab {
+    uint32_t magic;
+    uint16_t cls;       // size class index
+    uint16_t inuse;     // objects handed out (including ones in magazines)
+    void *free;         // free objects inside this slab, linked through word 0
+    struct slab *next;
+    struct slab *prev;
+};
+
+struct slab_class {
+    struct spinlock lock;
+    struct slab *partial;   // some objects free
+    struct slab *empty;     // all objects free
+    size_t nempty;
+    size_t nslabs;
+    size_t reclaimed;       // slab pages given back to kalloc
+};
+
+struct slab_pcp {
+    void *mag[SLAB_NCLASS][SLAB_MAG];
+    int n[SLAB_NCLASS];
+    size_t allocs;
+    size_t frees;
+} __attribute__((aligned(64)));
+
+static struct slab_class classes[SLAB_NCLASS];
+static struct slab_pcp slab_pcp[NCPU];
+
+static inline size_t class_size(int cls) {
+    return 1UL << (SLAB_MIN_SHIFT + cls);
+}
+
+static inline int class_objs(int cls) {
+    return (PGSIZE - SLAB_HDR) / class_size(cls);
+}
+
+static int size_to_class(size_t size) {
+    int cls = 0;
+    while (cls < SLAB_NCLASS && class_size(cls) < size) cls++;
+    return cls < SLAB_NCLASS ? cls : -1;
+}
+
+// ---- slab lists (caller holds the class lock) ----
+
+static void list_push(struct slab **head, struct slab *s) {
+    s->prev = NULL;
+    s->next = *head;
+    if (*head) (*head)->prev = s;
+    *head = s;
+}
+
+static void list_remove(struct slab **head, struct slab *s) {
+    if (s->prev) s->prev->next = s->next;
+    else *head = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+static struct slab *slab_new(int cls) {
+    // every byte we rely on is written below, so skip the page clear
+    struct slab *s = (struct slab *)kalloc_nozero();
+    if (!s) return NULL;
+    s->magic = SLAB_MAGIC;
+    s->cls = cls;
+    s->inuse = 0;
+    s->free = NULL;
+    size_t sz = class_size(cls);
+    char *obj = (char *)s + SLAB_HDR;
+    for (int i = class_objs(cls) - 1; i >= 0; i--) {
+        void **o = (void **)(obj + i * sz);
+        *o = s->free;
+        s->free = o;
+    }
+    return s;
+}
+
+// pull up to n objects from the class slabs into out[]; returns count.
+static int class_get(int cls, void **out, int n) {
+    struct slab_class *c = &classes[cls];
+    int per = class_objs(cls);
+    int got = 0;
+
+    acquire(&c->lock);
+    while (got < n) {
+        struct slab *s = c->partial;
+        if (s) {
+            list_remove(&c->partial, s);
+        } else if ((s = c->empty) != NULL) {
+            list_remove(&c->empty, s);
+            c->nempty--;
+        } else {
+            s = slab_new(cls);
+            if (!s) break;
+            c->nslabs++;
+        }
+        while (got < n && s->free) {
+            void **o = (void **)s->free;
+            s->free = *o;
+            s->inuse++;
+            out[got++] = o;
+        }
+        // full slabs live on no list until an object comes back
+        if (s->inuse < per)
+            list_push(&c->partial, s);
+    }
+    release(&c->lock);
+    return got;
+}
+
+// return n objects to their slabs; empty slabs beyond SLAB_KEEP_EMPTY are
+// handed back to kalloc. keep_empty < 0 means use the default.
+static void class_put(int cls, void **objs, int n, int keep_empty) {
+    struct slab_class *c = &classes[cls];
+    int per = class_objs(cls);
+    struct slab *victims = NULL;
+    if (keep_empty < 0) keep_empty = SLAB_KEEP_EMPTY;
+
+    acquire(&c->lock);
+    for (int i = 0; i < n; i++) {
+        struct slab *s = (struct slab *)PAGE_ALIGN_DOWN(objs[i]);
+        int was_full = (s->inuse == per);
+        *(void **)objs[i] = s->free;
+        s->free = objs[i];
+        s->inuse--;
+        if (!was_full)
+            list_remove(&c->partial, s);
+        if (s->inuse == 0) {
+            list_push(&c->empty, s);
+            c->nempty++;
+        } else {
+            list_push(&c->partial, s);
+        }
+    }
+    while (c->nempty > (size_t)keep_empty) {
+        struct slab *s = c->empty;
+        list_remove(&c->empty, s);
+        c->nempty--;
+        c->nslabs--;
+        c->reclaimed++;
+        s->magic = 0;
+        s->next = victims;
+        victims = s;
+    }
+    release(&c->lock);
+
+    while (victims) {
+        struct slab *s = victims;
+        victims = s->next;
+        kfree(s);
+    }
+}
+
+static void *large_alloc(size_t size) {
+    int order = 0;
+    while (order <= KMEM_MAX_ORDER && (PGSIZE << order) < size) order++;
+    if (order > KMEM_MAX_ORDER) return NULL;
+    return kalloc_pages(order);
+}
+
+// allocate size bytes; contents are not initialized.
+void *kmalloc(size_t size) {
+    if (size == 0) return NULL;
+    int cls = size_to_class(size);
+    if (cls < 0) return large_alloc(size);
+
+    void *obj = NULL;
+    int intr = intr_save();
+    struct slab_pcp *p = &slab_pcp[cpuid()];
+    if (p->n[cls] == 0)
+        p->n[cls] = class_get(cls, p->mag[cls], SLAB_MAG / 2);
+    if (p->n[cls] > 0) {
+        obj = p->mag[cls][--p->n[cls]];
+        p->allocs++;
+    }
+    intr_restore(intr);
+    return obj;
+}
+
+// kmalloc() and clear only the bytes asked for.
+void *kzalloc(size_t size) {
+    void *obj = kmalloc(size);
+    if (obj) memset(obj, 0, size);
+    return obj;
+}
+
+void kfree_obj(void *obj) {
+    if (!obj) return;
+    struct slab *s = (struct slab *)PAGE_ALIGN_DOWN(obj);
+    if ((void *)s == obj) {
+        kfree_pages(obj, kmem_page_order(obj));
+        return;
+    }
+    if (s->magic != SLAB_MAGIC || (uintptr_t)obj - (uintptr_t)s < SLAB_HDR)
+        panic("kfree_obj: not a kmalloc pointer");
+
+    int cls = s->cls;
+    int intr = intr_save();
+    struct slab_pcp *p = &slab_pcp[cpuid()];
+    if (p->n[cls] == SLAB_MAG) {
+        // magazine full: give the older half back to the slabs
+        class_put(cls, p->mag[cls], SLAB_MAG / 2, -1);
+        for (int i = 0; i < SLAB_MAG / 2; i++)
+            p->mag[cls][i] = p->mag[cls][i + SLAB_MAG / 2];
+        p->n[cls] -= SLAB_MAG / 2;
+    }
+    p->mag[cls][p->n[cls]++] = obj;
+    p->frees++;
+    intr_restore(intr);
+}
+
+// flush this hart's magazines and free every empty slab page.
+// returns the number of pages given back to kalloc.
+size_t kmem_slab_reclaim(void) {
+    size_t before = 0, after = 0;
+    int intr = intr_save();
+    struct slab_pcp *p = &slab_pcp[cpuid()];
+    for (int cls = 0; cls < SLAB_NCLASS; cls++) {
+        before += classes[cls].reclaimed;
+        class_put(cls, p->mag[cls], p->n[cls], 0);
+        p->n[cls] = 0;
+        after += classes[cls].reclaimed;
+    }
+    intr_restore(intr);
+    return after - before;
+}
+
+size_t kmem_slab_alloc_count(void) {
+    size_t v = 0;
+    for (int i = 0; i < NCPU; i++)
+        v += *(volatile size_t *)&slab_pcp[i].allocs;
+    return v;
+}
+
+size_t kmem_slab_pages(void) {
+    size_t v = 0;
+    for (int cls = 0; cls < SLAB_NCLASS; cls++) {
+        acquire(&classes[cls].lock);
+        v += classes[cls].nslabs;
+        release(&classes[cls].lock);
+    }
+    return v;
+}
+
+void kmem_print_slabs(void) {
+    size_t frees = 0;
+    for (int i = 0; i < NCPU; i++)
+        frees += *(volatile size_t *)&slab_pcp[i].frees;
+
+    printf("slab: size  slabs  empty  reclaimed\n");
+    for (int cls = 0; cls < SLAB_NCLASS; cls++) {
+        struct slab_class *c = &classes[cls];
+        acquire(&c->lock);
+        size_t nslabs = c->nslabs, nempty = c->nempty, reclaimed = c->reclaimed;
+        release(&c->lock);
+        printf("slab: %llu  %llu  %llu  %llu\n",
+               (unsigned long long)class_size(cls),
+               (unsigned long long)nslabs,
+               (unsigned long long)nempty,
+               (unsigned long long)reclaimed);
+    }
+    printf("slab: %llu allocs, %llu frees\n",
+           (unsigned long long)kmem_slab_alloc_count(),
+           (unsigned long long)frees);
+}
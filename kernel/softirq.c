@@ -0,0 +1,116 @@
+// kernel/softirq.c
+// 延后工作队列，见 softirq.h。
+// 队列是每个核自己的，只在本核上关着中断操作，不需要锁；
+// pending 用原子交换，同一个工作项不会同时排在两个核上。
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "defs.h"
+#include "softirq.h"
+
+struct softq {
+  struct work *head;
+  struct work *tail;
+  int running;                        // 正在执行，防止重入
+  struct softirq_stats st;
+} __attribute__((aligned(64)));
+
+static struct softq softq[NCPU];
+
+int
+work_queue(struct work *w)
+{
+  if(__atomic_exchange_n(&w->pending, 1, __ATOMIC_ACQ_REL))
+    return 0;
+  int intr = intr_save();
+  struct softq *q = &softq[cpuid()];
+  w->next = 0;
+  if(q->tail)
+    q->tail->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+  q->st.queued++;
+  if(++q->st.depth > q->st.max_depth)
+    q->st.max_depth = q->st.depth;
+  intr_restore(intr);
+  return 1;
+}
+
+int
+softirq_pending(void)
+{
+  return softq[cpuid()].head != 0;
+}
+
+// 按排队顺序执行，至少执行一项，之后超出 budget 就停。
+// 工作项按调用者的中断状态执行（中断返回路径上是开着的）
+int
+softirq_run(uint64 budget)
+{
+  int intr = intr_save();
+  struct softq *q = &softq[cpuid()];
+  if(q->running || q->head == 0){
+    intr_restore(intr);
+    return 0;
+  }
+  q->running = 1;
+  uint64 t0 = r_time();
+  int n = 0;
+  while(q->head){
+    if(n > 0 && r_time() - t0 > budget){
+      q->st.over_budget++;
+      break;
+    }
+    struct work *w = q->head;
+    q->head = w->next;
+    if(q->head == 0)
+      q->tail = 0;
+    q->st.depth--;
+    // 先清 pending，工作项可以在执行时把自己再排上
+    __atomic_store_n(&w->pending, 0, __ATOMIC_RELEASE);
+    intr_restore(intr);
+    w->fn(w->arg);
+    intr = intr_save();
+    n++;
+  }
+  uint64 dt = r_time() - t0;
+  q->st.run += n;
+  q->st.batches++;
+  q->st.time += dt;
+  if(dt > q->st.max_time)
+    q->st.max_time = dt;
+  q->running = 0;
+  intr_restore(intr);
+  return n;
+}
+
+// 空闲循环里的“内核工作线程”：把上一批超出预算剩下的跑完
+int
+softirq_idle(void)
+{
+  return softirq_run(~0UL);
+}
+
+void
+softirq_get_stats(int hart, struct softirq_stats *st)
+{
+  int intr = intr_save();
+  *st = softq[hart].st;
+  intr_restore(intr);
+}
+
+void
+softirq_print_stats(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    struct softirq_stats st;
+    softirq_get_stats(i, &st);
+    if(st.queued == 0)
+      continue;
+    printf("softirq: hart %d %llu queued, %llu run in %llu batches (%llu over budget)\n",
+           i, st.queued, st.run, st.batches, st.over_budget);
+    printf("softirq: hart %d depth %d max %d, %llu ticks total, %llu max per batch\n",
+           i, st.depth, st.max_depth, st.time, st.max_time);
+  }
+}
@@ -0,0 +1,39 @@
+// kernel/softirq.h
+// 每个核的延后工作队列（下半部）。中断处理函数（上半部）只确认设备、
+// 把耗时的部分用 work_queue() 排队；排队的工作在中断返回前开着中断
+// 成批执行，每批有时间预算，超出预算的留给空闲循环（softirq_idle()）。
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include "timer.h"
+
+#define SOFTIRQ_BUDGET (TIMER_HZ / 2000)  // 每批最多 0.5 毫秒
+
+// 一个工作项。用 WORK_INIT 静态初始化，或者清零后填 fn/arg
+struct work {
+  struct work *next;
+  void (*fn)(void *arg);
+  void *arg;
+  int pending;                        // 已经在某个核的队列里
+};
+#define WORK_INIT(f, a) { 0, (f), (a), 0 }
+
+struct softirq_stats {
+  uint64 queued;                      // work_queue() 成功排队的次数
+  uint64 run;                         // 执行过的工作项
+  uint64 batches;                     // 批数
+  uint64 over_budget;                 // 因为超出预算而没跑完的批数
+  uint64 time;                        // 执行用的总时间（time 计数）
+  uint64 max_time;                    // 最长的一批
+  int depth;                          // 现在排着的
+  int max_depth;                      // 排得最长的时候
+};
+
+int work_queue(struct work *w);         // 排到本核；已经排着返回 0
+int softirq_pending(void);
+int softirq_run(uint64 budget);         // 执行本核排着的工作，返回执行的个数
+int softirq_idle(void);                 // 空闲循环调用，不限预算
+void softirq_get_stats(int hart, struct softirq_stats *st);
+void softirq_print_stats(void);
+
+#endif // SOFTIRQ_H
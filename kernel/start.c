@@ -3,6 +3,7 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
+#include "timer.h"
 
 void main();
 void timerinit();
@@ -53,7 +54,7 @@ start()
   w_pmpcfg0(0xf);
 
   // --- 启动时钟 ---
-  // 调用 timerinit 函数，配置硬件时钟以使其开始周期性地产生中断。
+  // 调用 timerinit 函数，让 S-mode 可以自己设置时钟比较器（stimecmp）。
   timerinit();
 
   // --- 传递核心 ID ---
@@ -85,12 +86,12 @@ timerinit()
   // 这是一个较新的 RISC-V 扩展，允许 S-mode 直接访问和设置自己的时钟比较器 stimecmp。
   w_menvcfg(r_menvcfg() | (1L << 63)); 
   
-  // 允许 S-mode 访问 time 和 stimecmp 寄存器。
-  w_mcounteren(r_mcounteren() | 2);
+  // 允许 S-mode 访问 time 和 stimecmp 寄存器 (TM 位)，
+  // 以及 cycle 寄存器 (CY 位，性能测试用)。
+  w_mcounteren(r_mcounteren() | 2 | 1);
   
-  // --- 预约第一次 S-mode 时钟中断 ---
-  // 读取当前硬件时间 (time 寄存器)，加上一个间隔 (约 0.1 秒)，
-  // 然后将这个未来的时间点写入 S-mode 的时钟比较器 (stimecmp)。
-  // 当 time 的值增长到 stimecmp 的值时，就会触发第一个 S-mode 时钟中断。
-  w_stimecmp(r_time() + 1000000);
+  // --- 先不预约时钟中断 ---
+  // 没有周期性的 tick：S-mode 的 timer.c 有定时器要到期时才设置 stimecmp。
+  // 这里先设成永远不会到的时间，免得复位值 0 让时钟中断一直挂着。
+  w_stimecmp(TIMER_NEVER);
 }
\ No newline at end of file
@@ -0,0 +1,208 @@
+// swap.c - swap entries and the disk swap area
+//
+// An evicted page goes to the cheapest tier that takes it: an all-zero
+// page is only a flag in its PTE, a page that compresses well goes to the
+// RAM pool in zswap.c, and anything else to a slot on the virtio disk.
+//
+// The whole disk is the swap area, one slot per page (PGSIZE / 512
+// sectors), up to SWAP_MAX_SLOTS. Each slot has a reference count: a
+// swapped-out page shared copy-on-write is referred to by several PTEs,
+// and the slot is reused once the last of them swaps it in or unmaps it.
+// I/O is synchronous (virtio_disk_rw() polls for completion).
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include "swap.h"
+#include <string.h>
+
+#define SWAP_MAX_SLOTS 32768                    // 128 MiB of swap
+#define SLOT_SECTORS (PGSIZE / 512)
+
+static struct spinlock swap_lock = { 0, "swap" };
+static uint8 swap_map[SWAP_MAX_SLOTS];          // references per slot, 0 = free
+static size_t nslots = 0;                       // 0 = no swap disk
+static size_t used = 0;
+static size_t hand = 0;                         // next slot to try
+static uint64_t swap_outs = 0;
+static uint64_t swap_ins = 0;
+
+// swap-in cost per entry type, in cycles
+static struct {
+    uint64_t n;
+    uint64_t cycles;
+    uint64_t max;
+} swap_lat[SWAP_NTYPE];
+static uint64_t zero_outs = 0;
+
+static const char *type_name[SWAP_NTYPE] = { "disk", "zram", "zero" };
+
+void swapinit(void) {
+    zswap_init();
+    if (virtio_disk_init() != 0) {
+        printf("swap: no virtio disk, compressed pool only\n");
+        return;
+    }
+    size_t n = virtio_disk_capacity() / SLOT_SECTORS;
+    nslots = n < SWAP_MAX_SLOTS ? n : SWAP_MAX_SLOTS;
+    printf("swap: %llu slots (%llu KiB)\n",
+           (unsigned long long)nslots, (unsigned long long)(nslots * PGSIZE / 1024));
+}
+
+// ---- disk slots ----
+
+static long disk_alloc(void) {
+    long slot = -1;
+    acquire(&swap_lock);
+    for (size_t i = 0; i < nslots; i++) {
+        size_t s = (hand + i) % nslots;
+        if (swap_map[s] == 0) {
+            swap_map[s] = 1;
+            hand = s + 1;
+            used++;
+            slot = (long)s;
+            break;
+        }
+    }
+    release(&swap_lock);
+    return slot;
+}
+
+static void disk_dup(long slot) {
+    acquire(&swap_lock);
+    if (slot < 0 || (size_t)slot >= nslots || swap_map[slot] == 0)
+        panic("swap_dup: bad slot");
+    if (swap_map[slot] == 0xff)
+        panic("swap_dup: too many references");
+    swap_map[slot]++;
+    release(&swap_lock);
+}
+
+static void disk_free(long slot) {
+    acquire(&swap_lock);
+    if (slot < 0 || (size_t)slot >= nslots || swap_map[slot] == 0)
+        panic("swap_free: bad slot");
+    if (--swap_map[slot] == 0)
+        used--;
+    release(&swap_lock);
+}
+
+static int disk_write(long slot, void *page) {
+    if (virtio_disk_rw((uint64)slot * SLOT_SECTORS, page, PGSIZE, 1) != 0)
+        return -1;
+    __atomic_add_fetch(&swap_outs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int disk_read(long slot, void *page) {
+    if (virtio_disk_rw((uint64)slot * SLOT_SECTORS, page, PGSIZE, 0) != 0)
+        return -1;
+    __atomic_add_fetch(&swap_ins, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// ---- swap entries ----
+
+int swap_enabled(void) {
+    return 1;   // the compressed pool is always there
+}
+
+int swap_full(void) {
+    return zswap_full() && swap_used_slots() >= nslots;
+}
+
+static int page_is_zero(const void *page) {
+    const uint64 *w = page;
+    for (int i = 0; i < PGSIZE / 8; i++)
+        if (w[i]) return 0;
+    return 1;
+}
+
+// store a copy of page; flags are the PTE bits to keep in the entry.
+// the caller has already unmapped page, so it cannot change under us.
+uint64_t swap_out(void *page, uint64_t flags) {
+    if (page_is_zero(page)) {
+        __atomic_add_fetch(&zero_outs, 1, __ATOMIC_RELAXED);
+        return SWAP_PTE(SWAP_ZERO, 0, flags);
+    }
+    long h = zswap_store(page);
+    if (h >= 0)
+        return SWAP_PTE(SWAP_ZRAM, h, flags);
+    long slot = disk_alloc();
+    if (slot < 0)
+        return 0;
+    if (disk_write(slot, page) != 0) {
+        disk_free(slot);
+        return 0;
+    }
+    return SWAP_PTE(SWAP_DISK, slot, flags);
+}
+
+int swap_in_page(uint64_t ent, void *page) {
+    int type = PTE_SWAP_TYPE(ent);
+    long idx = PTE_SWAP_IDX(ent);
+    uint64_t t0 = r_cycle();
+    int r;
+    switch (type) {
+    case SWAP_ZERO: memset(page, 0, PGSIZE); r = 0; break;
+    case SWAP_ZRAM: r = zswap_load(idx, page); break;
+    case SWAP_DISK: r = disk_read(idx, page); break;
+    default: panic("swap_in_page: bad entry");
+    }
+    uint64_t dt = r_cycle() - t0;
+    acquire(&swap_lock);
+    swap_lat[type].n++;
+    swap_lat[type].cycles += dt;
+    if (dt > swap_lat[type].max) swap_lat[type].max = dt;
+    release(&swap_lock);
+    return r;
+}
+
+void swap_dup(uint64_t ent) {
+    switch (PTE_SWAP_TYPE(ent)) {
+    case SWAP_ZERO: break;
+    case SWAP_ZRAM: zswap_dup(PTE_SWAP_IDX(ent)); break;
+    case SWAP_DISK: disk_dup(PTE_SWAP_IDX(ent)); break;
+    default: panic("swap_dup: bad entry");
+    }
+}
+
+void swap_free(uint64_t ent) {
+    switch (PTE_SWAP_TYPE(ent)) {
+    case SWAP_ZERO: break;
+    case SWAP_ZRAM: zswap_free(PTE_SWAP_IDX(ent)); break;
+    case SWAP_DISK: disk_free(PTE_SWAP_IDX(ent)); break;
+    default: panic("swap_free: bad entry");
+    }
+}
+
+size_t swap_total_slots(void) {
+    return nslots;
+}
+
+size_t swap_used_slots(void) {
+    return __atomic_load_n(&used, __ATOMIC_RELAXED);
+}
+
+void swap_stats(uint64_t *outs, uint64_t *ins) {
+    if (outs) *outs = __atomic_load_n(&swap_outs, __ATOMIC_RELAXED);
+    if (ins) *ins = __atomic_load_n(&swap_ins, __ATOMIC_RELAXED);
+}
+
+void swap_print_stats(void) {
+    printf("swap: %llu zero pages, %llu disk writes, %llu/%llu slots\n",
+           (unsigned long long)__atomic_load_n(&zero_outs, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&swap_outs, __ATOMIC_RELAXED),
+           (unsigned long long)swap_used_slots(), (unsigned long long)nslots);
+    zswap_print_stats();
+    printf("swap: in   count  avg cycles  max cycles\n");
+    for (int t = 0; t < SWAP_NTYPE; t++) {
+        acquire(&swap_lock);
+        uint64_t n = swap_lat[t].n, cycles = swap_lat[t].cycles, max = swap_lat[t].max;
+        release(&swap_lock);
+        printf("swap: %s  %llu  %llu  %llu\n", type_name[t],
+               (unsigned long long)n, (unsigned long long)(n ? cycles / n : 0),
+               (unsigned long long)max);
+    }
+}
@@ -0,0 +1,59 @@
+// swap.h - where evicted user pages go (see swap.c and zswap.c)
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a swapped-out page lives in a non-valid PTE: PTE_SWAP set, PTE_V clear,
+// the page's R/W/X/U/COW bits kept in place so swap-in restores the same
+// permissions, and where the PPN would be a 2-bit type (bits 10-11) and
+// the index of the stored copy within that type.
+#define SWAP_DISK 0     // slot on the virtio disk
+#define SWAP_ZRAM 1     // compressed object in the RAM pool
+#define SWAP_ZERO 2     // page was all zeroes; nothing stored
+#define SWAP_NTYPE 3
+#define SWAP_BUSY 3     // vm.c is evicting the page right now; nothing stored
+
+#define PTE_SWAP_KEEP (PTE_R | PTE_W | PTE_X | PTE_U | PTE_COW)
+#define SWAP_PTE(type, idx, flags) \
+    (((uint64_t)(idx) << 12) | ((uint64_t)(type) << 10) | ((flags) & PTE_SWAP_KEEP) | PTE_SWAP)
+#define PTE_IS_SWAP(pte) (((pte) & (PTE_V | PTE_SWAP)) == PTE_SWAP)
+#define PTE_SWAP_TYPE(pte) (((pte) >> 10) & 3)
+#define PTE_SWAP_IDX(pte) ((pte) >> 12)
+#define PTE_IS_SWAP_BUSY(pte) (PTE_IS_SWAP(pte) && PTE_SWAP_TYPE(pte) == SWAP_BUSY)
+
+void swapinit(void);                        // compressed pool, then the swap disk if any
+int swap_enabled(void);                     // some tier is configured
+int swap_full(void);                        // no tier has room left
+uint64_t swap_out(void *page, uint64_t flags); // store page; its swap entry, or 0
+int swap_in_page(uint64_t ent, void *page); // copy back, 0 on success; ent stays
+void swap_dup(uint64_t ent);                // one more PTE refers to ent
+void swap_free(uint64_t ent);               // drop a reference
+
+size_t swap_total_slots(void);              // disk tier
+size_t swap_used_slots(void);
+void swap_stats(uint64_t *outs, uint64_t *ins);
+void swap_print_stats(void);
+
+// compressed RAM tier (zswap.c). handles are < 2^40.
+void zswap_init(void);
+int zswap_full(void);
+long zswap_store(const void *page);         // handle, or -1 (incompressible / pool full)
+int zswap_load(long h, void *page);
+void zswap_dup(long h);
+void zswap_free(long h);
+
+struct zswap_stats {
+    uint64_t stores;        // pages compressed into the pool
+    uint64_t rejects;       // pages that did not compress to ZS_MAX_LEN
+    uint64_t full;          // stores refused because the pool was at its cap
+    uint64_t loads;
+    uint64_t objects;       // live compressed pages
+    uint64_t bytes;         // compressed bytes in live objects
+    uint64_t pool_pages;    // kalloc pages held by the pool
+    uint64_t max_pages;
+};
+void zswap_get_stats(struct zswap_stats *st);
+void zswap_print_stats(void);
+#endif // SWAP_H
@@ -0,0 +1,184 @@
+// kernel/timer.c
+// 每个核的定时器队列，见 timer.h。
+// 堆按 deadline 排序，每个 struct timer 记住自己的下标，
+// 所以 timer_cancel() 是 O(log n)，不用找。
+// 任何核都可以取消别的核上的定时器，所以每个队列有一把锁；
+// 持锁时要关中断，否则本核的时钟中断进来会在同一把锁上死锁。
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include "timer.h"
+
+struct timerq {
+  struct spinlock lock;
+  struct timer *heap[NTIMERQ];
+  int n;
+  uint64 intrs;                       // 时钟中断次数
+  uint64 fired;                       // 到期执行的回调数
+  uint64 spurious;                    // 进来时什么也没到期
+} __attribute__((aligned(64)));
+
+static struct timerq timerq[NCPU];
+
+static void
+heap_set(struct timerq *q, int i, struct timer *t)
+{
+  q->heap[i] = t;
+  t->idx = i;
+}
+
+static void
+sift_up(struct timerq *q, int i)
+{
+  struct timer *t = q->heap[i];
+  while(i > 0){
+    int p = (i - 1) / 2;
+    if(q->heap[p]->deadline <= t->deadline)
+      break;
+    heap_set(q, i, q->heap[p]);
+    i = p;
+  }
+  heap_set(q, i, t);
+}
+
+static void
+sift_down(struct timerq *q, int i)
+{
+  struct timer *t = q->heap[i];
+  for(;;){
+    int c = 2 * i + 1;
+    if(c >= q->n)
+      break;
+    if(c + 1 < q->n && q->heap[c + 1]->deadline < q->heap[c]->deadline)
+      c++;
+    if(t->deadline <= q->heap[c]->deadline)
+      break;
+    heap_set(q, i, q->heap[c]);
+    i = c;
+  }
+  heap_set(q, i, t);
+}
+
+static void
+heap_remove(struct timerq *q, int i)
+{
+  struct timer *t = q->heap[i];
+  struct timer *last = q->heap[--q->n];
+  t->hart = 0;
+  if(i == q->n)
+    return;
+  heap_set(q, i, last);
+  sift_up(q, i);
+  sift_down(q, last->idx);
+}
+
+// 把本核的 stimecmp 设成最早的到期时间。持有本核队列的锁
+static void
+timer_program(struct timerq *q)
+{
+  w_stimecmp(q->n ? q->heap[0]->deadline : TIMER_NEVER);
+}
+
+void
+timerinithart(void)
+{
+  struct timerq *q = &timerq[cpuid()];
+  initlock(&q->lock, "timerq");
+  q->n = 0;
+  w_stimecmp(TIMER_NEVER);
+}
+
+// 把 t 挂到本核的队列上，deadline 到了之后在本核调用 fn(arg)。
+// t 已经挂着时先摘下来再挂。队列满返回 -1
+int
+timer_add(struct timer *t, uint64 deadline, void (*fn)(void *), void *arg)
+{
+  timer_cancel(t);
+  int intr = intr_save();
+  struct timerq *q = &timerq[cpuid()];
+  acquire(&q->lock);
+  if(q->n == NTIMERQ){
+    release(&q->lock);
+    intr_restore(intr);
+    return -1;
+  }
+  t->deadline = deadline;
+  t->fn = fn;
+  t->arg = arg;
+  t->hart = cpuid() + 1;
+  heap_set(q, q->n++, t);
+  sift_up(q, t->idx);
+  if(q->heap[0] == t)
+    timer_program(q);
+  release(&q->lock);
+  intr_restore(intr);
+  return 0;
+}
+
+// 摘下 t。返回 1 表示它还没到期就被取消了；0 表示没挂着
+// （已经到期，回调可能正在别的核上运行）
+int
+timer_cancel(struct timer *t)
+{
+  int intr = intr_save();
+  for(;;){
+    int hart = __atomic_load_n(&t->hart, __ATOMIC_ACQUIRE);
+    if(hart == 0){
+      intr_restore(intr);
+      return 0;
+    }
+    struct timerq *q = &timerq[hart - 1];
+    acquire(&q->lock);
+    if(t->hart != hart){
+      // 拿锁之前它到期或者被挪走了，重来
+      release(&q->lock);
+      continue;
+    }
+    int first = t->idx == 0;
+    heap_remove(q, t->idx);
+    // 别的核的 stimecmp 我们写不了；那边多来一次中断，看没有到期的就重新设置
+    if(first && hart - 1 == cpuid())
+      timer_program(q);
+    release(&q->lock);
+    intr_restore(intr);
+    return 1;
+  }
+}
+
+// 时钟中断：执行所有到期的回调，然后按新的最早到期时间设置 stimecmp。
+// 回调运行时不持锁，所以回调里可以 timer_add()/timer_cancel()
+void
+timer_intr(void)
+{
+  struct timerq *q = &timerq[cpuid()];
+  int fired = 0;
+  acquire(&q->lock);
+  q->intrs++;
+  while(q->n && q->heap[0]->deadline <= r_time()){
+    struct timer *t = q->heap[0];
+    heap_remove(q, 0);
+    release(&q->lock);
+    t->fn(t->arg);
+    fired++;
+    acquire(&q->lock);
+  }
+  q->fired += fired;
+  if(fired == 0)
+    q->spurious++;
+  timer_program(q);
+  release(&q->lock);
+}
+
+void
+timer_print_stats(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    struct timerq *q = &timerq[i];
+    if(q->lock.name == 0)
+      continue;   // 这个核还没初始化
+    printf("timer: hart %d %d pending, %llu interrupts, %llu fired, %llu spurious\n",
+           i, q->n, q->intrs, q->fired, q->spurious);
+  }
+}
@@ -0,0 +1,28 @@
+// kernel/timer.h
+// 每个核一个定时器队列（最小堆），stimecmp 总是设成最早的到期时间；
+// 队列空的核不再收到时钟中断。时间单位是 time 寄存器的计数
+// （QEMU virt 上 10 MHz，即 100ns）。
+#ifndef TIMER_H
+#define TIMER_H
+
+#define TIMER_HZ 10000000UL           // time 寄存器每秒的计数
+#define TIMER_NEVER (~0UL)            // stimecmp 设成它就不会再触发
+#define NTIMERQ 64                    // 每个核最多挂这么多定时器
+
+// 调用者自己分配（清零即可用），timer_add() 挂上，到期或 timer_cancel() 后摘下。
+// 回调在时钟中断里、关中断的情况下运行，要短；可以在回调里再次 timer_add() 自己
+struct timer {
+  uint64 deadline;                    // 到期时刻（r_time() 的值）
+  void (*fn)(void *arg);
+  void *arg;
+  int hart;                           // 挂在哪个核的队列上（核号 + 1），0 = 没挂
+  int idx;                            // 在堆里的下标
+};
+
+void timerinithart(void);
+int timer_add(struct timer *t, uint64 deadline, void (*fn)(void *), void *arg);
+int timer_cancel(struct timer *t);
+void timer_intr(void);                // clockintr() 调用
+void timer_print_stats(void);
+
+#endif // TIMER_H
@@ -4,54 +4,256 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
+#include "vm.h"
+#include "trapstat.h"
+#include "timer.h"
+#include "softirq.h"
 
 // 我们用一个 volatile 变量确保编译器不会优化掉它
 volatile uint ticks;
+// 每个核自己的中断栈，中断入口通过 sscratch 换到这里（见 kernelvec.S）
 __attribute__ ((aligned (16))) char trap_stack[NCPU][4096];
 extern void uartintr(void);
 extern void virtio_disk_intr(void);
-volatile int timer_test_interrupt_count = 0;//testuse
-// 在 kernelvec.S 中，会调用 kerneltrap()
+volatile uint64 soft_interrupt_count = 0;
+// 在 kernelvec.S 中：kernelvec 保存全部寄存器后调用 kerneltrap()，
+// kernelvec_table 是向量模式的入口表，时钟/外部/软件中断各有自己的入口
 void kernelvec();
+void kernelvec_table();
 
 extern int devintr();
+void clockintr();
+static void plicintr(void);
+static void softintr(void);
 
-// S模式下的陷阱初始化
+#define INTR_MAX_DEPTH 2          // 外部中断里最多再被时钟/软件中断打断一层
+#define INTR_STACK_GUARD 512      // 中断栈剩余不到这么多字节就当作溢出
+#define INTR_STACK_MAGIC 0x5a5aa5a5deadbeefUL  // 中断栈底部的哨兵
+
+// 每个核的中断嵌套状态
+struct hartintr {
+  int depth;                      // 当前嵌套层数，0 = 不在中断里
+  int max_depth;                  // 出现过的最大层数
+  uint64 nested;                  // 打断了另一个中断处理函数的次数
+  uint64 min_free;                // 中断栈历史最小剩余字节
+  // intr_nest_on() 保存的现场，每层一份
+  uint64 sepc[INTR_MAX_DEPTH + 1];
+  uint64 sstatus[INTR_MAX_DEPTH + 1];
+  uint64 sie[INTR_MAX_DEPTH + 1];
+} __attribute__((aligned(64)));
+static struct hartintr hartintr[NCPU];
+
+// S模式下的陷阱初始化：向量模式，中断直接跳到各自的入口；
+// 中断栈放好哨兵，sscratch 指向栈顶
 void trapinithart(void)
 {
-  w_stvec((uint64)kernelvec);
+  int id = cpuid();
+  *(uint64 *)trap_stack[id] = INTR_STACK_MAGIC;
+  hartintr[id].min_free = sizeof(trap_stack[id]);
+  w_sscratch((uint64)trap_stack[id] + sizeof(trap_stack[id]));
+  w_stvec((uint64)kernelvec_table | STVEC_MODE_VECTORED);
+  w_sie(r_sie() | SIE_SSIE);
+}
+
+// 进入中断处理：记录嵌套层数，检查中断栈还够不够用
+static struct hartintr *
+intr_enter(void)
+{
+  int id = cpuid();
+  struct hartintr *h = &hartintr[id];
+  uint64 free = r_sp() - (uint64)trap_stack[id];
+  if(free > sizeof(trap_stack[id]))
+    panic("intr_enter: not on the interrupt stack");
+  if(free < h->min_free)
+    h->min_free = free;
+  if(free < INTR_STACK_GUARD || *(uint64 *)trap_stack[id] != INTR_STACK_MAGIC)
+    panic("interrupt stack overflow");
+  if(++h->depth > 1)
+    h->nested++;
+  if(h->depth > h->max_depth)
+    h->max_depth = h->depth;
+  return h;
+}
+
+static void
+intr_exit(struct hartintr *h)
+{
+  if(*(uint64 *)trap_stack[cpuid()] != INTR_STACK_MAGIC)
+    panic("interrupt stack overflow");
+  h->depth--;
+}
+
+// 在中断处理函数里重新开中断，sie 里去掉 mask 这几位
+static int
+nest_on(struct hartintr *h, uint64 mask)
+{
+  if(h->depth == 0 || h->depth >= INTR_MAX_DEPTH)
+    return 0;
+  // 嵌套的 trap 会覆盖 sepc 和 sstatus 的 SPP/SPIE，先存起来
+  h->sepc[h->depth] = r_sepc();
+  h->sstatus[h->depth] = r_sstatus();
+  h->sie[h->depth] = r_sie();
+  w_sie(h->sie[h->depth] & ~mask);
+  intr_on();
+  return 1;
+}
+
+// 长时间运行的中断处理函数可以调用它重新开中断，让时钟中断和
+// 软件中断（核间中断）抢占进来；外部中断仍然屏蔽，避免设备中断互相嵌套。
+// 嵌套已经到 INTR_MAX_DEPTH 层时什么也不做。返回值交给 intr_nest_off()
+int
+intr_nest_on(void)
+{
+  return nest_on(&hartintr[cpuid()], SIE_SEIE);
+}
+
+void
+intr_nest_off(int on)
+{
+  if(!on)
+    return;
+  intr_off();
+  struct hartintr *h = &hartintr[cpuid()];
+  w_sie(h->sie[h->depth]);
+  w_sepc(h->sepc[h->depth]);
+  w_sstatus(h->sstatus[h->depth]);
+}
+
+// 最外层的中断返回前执行本核排着的下半部（softirq.c），每批有时间预算。
+// 这时所有中断都开着，再进来的中断在第二层，只确认设备、排队，不会再进这里
+static void
+intr_softirq(struct hartintr *h)
+{
+  if(h->depth != 1 || !softirq_pending())
+    return;
+  int on = nest_on(h, 0);
+  softirq_run(SOFTIRQ_BUDGET);
+  intr_nest_off(on);
+}
+
+// 以下三个函数由 kernelvec.S 里只保存调用者保存寄存器的入口调用，
+// 不经过 kerneltrap()/devintr()；它们都运行在本核的中断栈上
+void
+timertrap(void)
+{
+  struct hartintr *h = intr_enter();
+  TRAPSTAT_START(t0);
+  clockintr();
+  TRAPSTAT_STOP(t0, 0x8000000000000005L);
+  intr_softirq(h);
+  intr_exit(h);
+}
+
+// 设备的上半部只确认设备、把活排进 softirq，关着中断跑完
+void
+externtrap(void)
+{
+  struct hartintr *h = intr_enter();
+  TRAPSTAT_START(t0);
+  plicintr();
+  TRAPSTAT_STOP(t0, 0x8000000000000009L);
+  intr_softirq(h);
+  intr_exit(h);
+}
+
+void
+softtrap(void)
+{
+  struct hartintr *h = intr_enter();
+  TRAPSTAT_START(t0);
+  softintr();
+  TRAPSTAT_STOP(t0, 0x8000000000000001L);
+  intr_softirq(h);
+  intr_exit(h);
+}
+
+static void
+softintr(void)
+{
+  w_sip(r_sip() & ~SIP_SSIP);
+  soft_interrupt_count++;
+}
+
+// 打印每个核的中断嵌套和中断栈使用情况
+void
+intr_print_stats(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    struct hartintr *h = &hartintr[i];
+    if(h->min_free == 0)
+      continue;   // 这个核还没初始化中断
+    printf("intr: hart %d max depth %d, %llu nested, stack low water %llu/%llu bytes free\n",
+           i, h->max_depth, h->nested, h->min_free, (uint64)sizeof(trap_stack[i]));
+  }
 }
 
 //
 // 处理来自 supervisor mode 的中断、异常或系统调用
 // 由 kernelvec.S 调用
 //
+static void exctrap(uint64 scause);
+
 void
 kerneltrap()
 {
-  // devintr() 会处理中断并返回
+  uint64 scause = r_scause();
+  TRAPSTAT_START(t0);
+  exctrap(scause);
+  TRAPSTAT_STOP(t0, scause);
+}
+
+static void
+exctrap(uint64 scause)
+{
+  // 缺页异常（12 取指 / 13 读 / 15 写）先交给 vm_fault()，
+  // 例如写时复制页的第一次写入；处理成功就直接返回，重新执行那条指令
+  if(scause == 12 || scause == 13 || scause == 15){
+    if(vm_fault(vm_current_pagetable(), r_stval(), scause) == 0)
+      return;
+  }
+
+  // 断点（ebreak）：跳过这条指令继续执行，bench 用它测异常路径的开销。
+  // 指令最低两位是 11 的是 4 字节指令，否则是 2 字节的压缩指令
+  if(scause == 3){
+    uint64 pc = r_sepc();
+    w_sepc(pc + ((*(uint16 *)pc & 3) == 3 ? 4 : 2));
+    return;
+  }
+
+  // devintr() 会处理中断并返回（无法处理的异常在里面 panic）。
+  // 向量模式下中断不会走到这里，除非 stvec 被临时切回了直接模式
   devintr();
 }
 
-// 时钟中断处理函数
+// 时钟中断处理函数：不再有固定周期的 tick，
+// 执行本核到期的定时器，再把 stimecmp 设成下一个到期时间（见 timer.c）
 void
 clockintr()
 {
-  // 这是一个简单的原子操作，对于我们目前的单线程内核足够了
-  //timer_test_interrupt_count++;
-  //printf("clock%d\n",timer_test_interrupt_count);
-  //printf("clock\n");
-  // 每隔一段时间打印一次，证明时钟在工作
-  // 注意：频繁打印会极大地拖慢系统
-  //if (ticks % 100 == 0) {
-  //    printf("tick\n");
-  //}
-  //printf("clock\n");
-  if(timer_test_interrupt_count>0&&timer_test_interrupt_count<=6){
-    timer_test_interrupt_count++;
-    printf("tick%d",timer_test_interrupt_count);
+  timer_intr();
+}
+
+// 外部中断：向 PLIC 领取中断号，分发给设备的处理函数
+static void
+plicintr(void)
+{
+  // 调用 plic_claim() 查询是哪个外部设备（如 UART）触发了中断。
+  int irq = plic_claim();
+  TRAPSTAT_START(t0);
+
+  if(irq == UART0_IRQ){
+    uartintr();// 调用 UART 的中断处理函数
+  } else if(irq == VIRTIO0_IRQ){// ... 其他设备
+    virtio_disk_intr();
+  } else if(irq){
+    printf("unexpected interrupt irq=%d\n", irq);
+  }
+
+  // 通知 PLIC，这个中断已经处理完毕，可以接收来自该设备的下一个中断了。
+  if(irq){
+    plic_complete(irq);
+    TRAPSTAT_STOP_IRQ(t0, irq);
   }
-  w_stimecmp(r_time() + 1000000);
 }
 
 // 检查是外部中断还是软件中断，并处理它
@@ -67,23 +269,15 @@ devintr()
 
   // scause 最高位为 1 表示是中断，最低几位是中断号。
   // 中断号 9 代表 Supervisor External Interrupt (来自 PLIC 的外部中断)。
-  if(scause == 0x8000000000000009L){//其实暂时不会进入这个分支
-    // 调用 plic_claim() 查询是哪个外部设备（如 UART）触发了中断。
-    int irq = plic_claim();
-
-    if(irq == UART0_IRQ){
-      uartintr();// 调用 UART 的中断处理函数
-    } else if(irq == VIRTIO0_IRQ){// ... 其他设备
-      virtio_disk_intr();
-    } else if(irq){
-      printf("unexpected interrupt irq=%d\n", irq);
-    }
-
-    // 通知 PLIC，这个中断已经处理完毕，可以接收来自该设备的下一个中断了。
-    if(irq)
-      plic_complete(irq);
+  if(scause == 0x8000000000000009L){
+    plicintr();
     return 1; // 返回 1 代表是外部中断
 
+  // 中断号 1 代表 Supervisor Software Interrupt。
+  } else if(scause == 0x8000000000000001L){
+    softintr();
+    return 1;
+
   // 中断号 5 代表 Supervisor Timer Interrupt (S-mode 时钟中断)。
   } else if(scause == 0x8000000000000005L){
     // 调用我们定义的时钟中断处理函数 clockintr()。
@@ -0,0 +1,114 @@
+// kernel/trapstat.c
+// 陷阱延迟直方图，见 trapstat.h。每个核只写自己的那一份，
+// 记录时关中断，所以不需要锁。
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "defs.h"
+#include "trapstat.h"
+
+#ifdef TRAPSTAT
+
+struct latstat {
+  uint64 n;
+  uint64 total;
+  uint64 max;
+  uint32 hist[TRAPSTAT_NBUCKET];
+};
+
+struct trapstat {
+  struct latstat cause[TRAPSTAT_NCAUSE];
+  struct latstat irq[TRAPSTAT_NIRQ];
+} __attribute__((aligned(64)));
+
+static struct trapstat trapstat[NCPU];
+
+// floor(log2(x))，x = 0 算在第 0 格
+static int
+log2_bucket(uint64 x)
+{
+  int k = 0;
+  while(x > 1 && k < TRAPSTAT_NBUCKET - 1){
+    x >>= 1;
+    k++;
+  }
+  return k;
+}
+
+static void
+latstat_add(struct latstat *s, uint64 cycles)
+{
+  int intr = intr_save();
+  s->n++;
+  s->total += cycles;
+  if(cycles > s->max)
+    s->max = cycles;
+  s->hist[log2_bucket(cycles)]++;
+  intr_restore(intr);
+}
+
+// scause 的最高位是中断标志，低位是编号
+static int
+cause_index(uint64 scause)
+{
+  int code = scause & 0xf;
+  return (scause >> 63) ? 16 + code : code;
+}
+
+void
+trapstat_cause(uint64 scause, uint64 cycles)
+{
+  latstat_add(&trapstat[cpuid()].cause[cause_index(scause)], cycles);
+}
+
+void
+trapstat_irq(int irq, uint64 cycles)
+{
+  if(irq >= 0 && irq < TRAPSTAT_NIRQ)
+    latstat_add(&trapstat[cpuid()].irq[irq], cycles);
+}
+
+static void
+latstat_print(int hart, char *kind, int num, struct latstat *s)
+{
+  printf("trapstat: hart %d %s %d: n %llu avg %llu max %llu cycles\n",
+         hart, kind, num, s->n, s->total / s->n, s->max);
+  printf("trapstat:  ");
+  for(int k = 0; k < TRAPSTAT_NBUCKET; k++)
+    if(s->hist[k])
+      printf(" 2^%d:%u", k, s->hist[k]);
+  printf("\n");
+}
+
+// 在控制台上打印所有非空的直方图
+void
+trapstat_dump(void)
+{
+  for(int h = 0; h < NCPU; h++){
+    for(int i = 0; i < TRAPSTAT_NCAUSE; i++){
+      struct latstat *s = &trapstat[h].cause[i];
+      if(s->n)
+        latstat_print(h, i < 16 ? "exception" : "interrupt", i & 0xf, s);
+    }
+    for(int i = 0; i < TRAPSTAT_NIRQ; i++){
+      struct latstat *s = &trapstat[h].irq[i];
+      if(s->n)
+        latstat_print(h, "irq", i, s);
+    }
+  }
+}
+
+// 清空本核的统计
+void
+trapstat_reset(void)
+{
+  int intr = intr_save();
+  struct trapstat *t = &trapstat[cpuid()];
+  for(int i = 0; i < TRAPSTAT_NCAUSE; i++)
+    t->cause[i] = (struct latstat){ 0 };
+  for(int i = 0; i < TRAPSTAT_NIRQ; i++)
+    t->irq[i] = (struct latstat){ 0 };
+  intr_restore(intr);
+}
+
+#endif // TRAPSTAT
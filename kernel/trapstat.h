@@ -0,0 +1,31 @@
+// kernel/trapstat.h
+// 陷阱延迟统计：每个核、每种 scause 和每个 PLIC 中断号一张 log2 直方图，
+// 另有次数、总周期数和最大值。用 rdcycle 计时，从 C 处理函数入口
+// 量到出口（嵌套进来的中断的时间也算在外层里）。
+// 用 make TRAPSTAT=0 编译时这些宏全部展开为空，不留任何开销。
+#ifndef TRAPSTAT_H
+#define TRAPSTAT_H
+
+#define TRAPSTAT_NCAUSE 32    // 0-15 异常，16-31 中断
+#define TRAPSTAT_NIRQ 32      // PLIC 中断号
+#define TRAPSTAT_NBUCKET 32   // 第 k 格：[2^k, 2^(k+1)) 个周期
+
+#ifdef TRAPSTAT
+void trapstat_cause(uint64 scause, uint64 cycles);
+void trapstat_irq(int irq, uint64 cycles);
+void trapstat_dump(void);
+void trapstat_reset(void);
+
+#define TRAPSTAT_START(v)           uint64 v = r_cycle()
+#define TRAPSTAT_STOP(v, scause)    trapstat_cause((scause), r_cycle() - (v))
+#define TRAPSTAT_STOP_IRQ(v, irq)   trapstat_irq((irq), r_cycle() - (v))
+#else
+#define TRAPSTAT_START(v)           do { } while(0)
+#define TRAPSTAT_STOP(v, scause)    do { } while(0)
+#define TRAPSTAT_STOP_IRQ(v, irq)   do { } while(0)
+
+static inline void trapstat_dump(void) { printf("trapstat: disabled (make TRAPSTAT=1)\n"); }
+static inline void trapstat_reset(void) { }
+#endif
+
+#endif // TRAPSTAT_H
@@ -1,5 +1,10 @@
 #include <stdint.h>
+#include "types.h"
 #include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "softirq.h"
 
 #define Reg(reg) ((volatile unsigned char *)(UART0 + reg))
 
@@ -18,10 +23,26 @@
 #define LSR 5                 // line status register
 #define LSR_RX_READY (1<<0)   // input is waiting to be read from RHR
 #define LSR_TX_IDLE (1<<5)    // THR can accept another character to send
+#define UART_FIFO 16          // transmit FIFO depth
 
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
+// 发送环：uartputc() 往里放，FIFO 空了由发送中断（或下一次 uartputc()）搬走
+#define UART_TX_SIZE 1024
+static struct {
+  struct spinlock lock;
+  char buf[UART_TX_SIZE];
+  uint r;                             // 已经写进 FIFO 的
+  uint w;                             // uartputc() 放到哪
+  int ier;                            // IER 现在的值
+  int drop;                           // 满了丢字符而不是等
+  uint64 sent;
+  uint64 bursts;                      // 往 FIFO 里塞了几回
+  uint64 dropped;
+  uint64 waits;                       // 满了等的次数
+} uart_tx;
+
 void
 uartinit(void)
 {
@@ -40,15 +61,88 @@ uartinit(void)
     WriteReg(FCR, FCR_FIFO_ENABLE | FCR_FIFO_CLEAR);
 
     // 重新开启接收中断 (为之后接收键盘输入做准备)
+    // 发送中断等发送环里有东西时再开
     WriteReg(IER, IER_RX_ENABLE);
+
+    initlock(&uart_tx.lock, "uart_tx");
+    uart_tx.ier = IER_RX_ENABLE;
+}
+
+// 把发送环里的字符搬进 FIFO：THR 空了（FIFO 也空了）就一次塞 UART_FIFO 个。
+// 环里还有剩的就开发送中断，FIFO 再空时 uartintr() 接着搬；
+// 搬空了就关掉，免得空转。持有 uart_tx.lock
+static void
+uartstart(void)
+{
+  if(uart_tx.r != uart_tx.w && (ReadReg(LSR) & LSR_TX_IDLE)){
+    int n = 0;
+    while(n < UART_FIFO && uart_tx.r != uart_tx.w){
+      WriteReg(THR, uart_tx.buf[uart_tx.r % UART_TX_SIZE]);
+      uart_tx.r++;
+      n++;
+    }
+    uart_tx.sent += n;
+    uart_tx.bursts++;
+  }
+  int ier = IER_RX_ENABLE | (uart_tx.r != uart_tx.w ? IER_TX_ENABLE : 0);
+  if(ier != uart_tx.ier){
+    uart_tx.ier = ier;
+    WriteReg(IER, ier);
+  }
 }
-/* 单字节写入（非常简化） */
-void uartputc(char c) {
-    
+
+// 放进发送环就返回，由发送中断送出去。环满时按 uart_tx_drop() 设的策略：
+// 丢掉并计数，或者原地轮询 FIFO 腾出位置（关着中断也能往前走）。
+// panic 之后改走同步路径
+void uartputc(int c) {
+  if(panicked){
+    uartputc_sync(c);
+    return;
+  }
+  int intr = intr_save();
+  acquire(&uart_tx.lock);
+  if(uart_tx.w - uart_tx.r == UART_TX_SIZE){
+    if(uart_tx.drop){
+      uart_tx.dropped++;
+      release(&uart_tx.lock);
+      intr_restore(intr);
+      return;
+    }
+    uart_tx.waits++;
+    while(uart_tx.w - uart_tx.r == UART_TX_SIZE)
+      uartstart();
+  }
+  uart_tx.buf[uart_tx.w % UART_TX_SIZE] = c;
+  uart_tx.w++;
+  uartstart();
+  release(&uart_tx.lock);
+  intr_restore(intr);
+}
+
+// 同步输出一个字符，不用锁也不用中断，给 panic() 用。
+// 先把发送环里还没发出去的按顺序吐完
+void uartputc_sync(int c) {
+  int intr = intr_save();
+  while(uart_tx.r != uart_tx.w){
     while((ReadReg(LSR) & LSR_TX_IDLE) == 0)
+      ;
+    WriteReg(THR, uart_tx.buf[uart_tx.r % UART_TX_SIZE]);
+    uart_tx.r++;
+  }
+  while((ReadReg(LSR) & LSR_TX_IDLE) == 0)
     ;
-    /* 对于 QEMU virt 的简单实验，直接写数据寄存器通常就能输出 */
-    WriteReg(THR,c);
+  WriteReg(THR, c);
+  intr_restore(intr);
+}
+
+// 发送环满了怎么办：on = 1 丢掉并计数，0 等（默认）
+void uart_tx_drop(int on) {
+  uart_tx.drop = on;
+}
+
+void uart_print_stats(void) {
+  printf("uart: %llu bytes sent in %llu bursts, %llu dropped, %llu waits for room\n",
+         uart_tx.sent, uart_tx.bursts, uart_tx.dropped, uart_tx.waits);
 }
 
 /* 字符串输出 */
@@ -56,8 +150,57 @@ void uartputs(const char *s) {
     while (*s) uartputc(*s++);
 }
 
+// 收到的字符先放在这个环里，上半部写、下半部读。
+// PLIC 同一时刻只把 UART 中断交给一个核处理，写者只有一个。
+// 下半部同一时刻只会排在一个核上（work 的 pending），但亲和性改了以后，
+// 它可能还在一个核上跑着，又被新核的上半部排到新核上；用 busy 保证只有一个在读
+#define UART_RX_SIZE 64
+static struct {
+  char buf[UART_RX_SIZE];
+  volatile uint r;                    // 下半部读到哪
+  volatile uint w;                    // 上半部写到哪
+  int busy;                           // 有下半部正在读
+  uint64 dropped;                     // 环满了丢掉的字符
+} uart_rx;
+
+static void uartrx(void *arg);
+static struct work uart_rx_work = WORK_INIT(uartrx, 0);
+
+// 上半部：读空 RHR（读完接收中断就清掉了），处理交给下半部；
+// FIFO 空了就从发送环再塞一批进去
 void uartintr(void)
 {
-  // 这是一个占位函数，目前什么都不做
-  // 之后我们会在这里处理键盘输入
+  acquire(&uart_tx.lock);
+  uartstart();
+  release(&uart_tx.lock);
+
+  while(ReadReg(LSR) & LSR_RX_READY){
+    char c = ReadReg(RHR);
+    if(uart_rx.w - uart_rx.r < UART_RX_SIZE){
+      uart_rx.buf[uart_rx.w % UART_RX_SIZE] = c;
+      __sync_synchronize();
+      uart_rx.w++;
+    } else {
+      uart_rx.dropped++;
+    }
+  }
+  if(uart_rx.r != uart_rx.w)
+    work_queue(&uart_rx_work);
+}
+
+// 下半部：开着中断把字符交给控制台
+static void uartrx(void *arg)
+{
+  // 放开 busy 之后再看一眼：别的核的下半部可能刚因为 busy 走掉
+  while(uart_rx.r != uart_rx.w){
+    if(__atomic_exchange_n(&uart_rx.busy, 1, __ATOMIC_ACQUIRE))
+      return;
+    while(uart_rx.r != uart_rx.w){
+      __sync_synchronize();
+      char c = uart_rx.buf[uart_rx.r % UART_RX_SIZE];
+      uart_rx.r++;
+      consoleintr(c);
+    }
+    __atomic_store_n(&uart_rx.busy, 0, __ATOMIC_RELEASE);
+  }
 }
\ No newline at end of file
@@ -0,0 +1,91 @@
+// kernel/virtio.h
+// virtio 设备定义，包括 MMIO 寄存器和 virtqueue 的内存布局。
+// 参考 virtio 1.1 规范（MMIO 第 2 版，即 qemu 的
+// -global virtio-mmio.force-legacy=false）。
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+// virtio mmio 控制寄存器，相对 VIRTIO0 的偏移
+#define VIRTIO_MMIO_MAGIC_VALUE       0x000 // 0x74726976
+#define VIRTIO_MMIO_VERSION           0x004 // 应为 2
+#define VIRTIO_MMIO_DEVICE_ID         0x008 // 设备类型：1 网卡，2 块设备
+#define VIRTIO_MMIO_VENDOR_ID         0x00c // 0x554d4551
+#define VIRTIO_MMIO_DEVICE_FEATURES   0x010
+#define VIRTIO_MMIO_DRIVER_FEATURES   0x020
+#define VIRTIO_MMIO_QUEUE_SEL         0x030 // 选择队列，只写
+#define VIRTIO_MMIO_QUEUE_NUM_MAX     0x034 // 当前队列的最大长度，只读
+#define VIRTIO_MMIO_QUEUE_NUM         0x038 // 当前队列的长度，只写
+#define VIRTIO_MMIO_QUEUE_READY       0x044 // 队列就绪位
+#define VIRTIO_MMIO_QUEUE_NOTIFY      0x050 // 只写
+#define VIRTIO_MMIO_INTERRUPT_STATUS  0x060 // 只读
+#define VIRTIO_MMIO_INTERRUPT_ACK     0x064 // 只写
+#define VIRTIO_MMIO_STATUS            0x070 // 读写
+#define VIRTIO_MMIO_QUEUE_DESC_LOW    0x080 // 描述符表的物理地址，只写
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH   0x084
+#define VIRTIO_MMIO_DRIVER_DESC_LOW   0x090 // avail 环的物理地址，只写
+#define VIRTIO_MMIO_DRIVER_DESC_HIGH  0x094
+#define VIRTIO_MMIO_DEVICE_DESC_LOW   0x0a0 // used 环的物理地址，只写
+#define VIRTIO_MMIO_DEVICE_DESC_HIGH  0x0a4
+#define VIRTIO_MMIO_CONFIG            0x100 // 设备配置空间（块设备：容量，单位扇区）
+
+// 状态寄存器的位
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
+#define VIRTIO_CONFIG_S_DRIVER      2
+#define VIRTIO_CONFIG_S_DRIVER_OK   4
+#define VIRTIO_CONFIG_S_FEATURES_OK 8
+
+// 设备特性位
+#define VIRTIO_BLK_F_RO             5  // 只读磁盘
+#define VIRTIO_BLK_F_SCSI           7  // 支持 scsi 命令透传
+#define VIRTIO_BLK_F_CONFIG_WCE     11 // 配置空间里有写回模式
+#define VIRTIO_BLK_F_MQ             12 // 支持多个 virtqueue
+#define VIRTIO_F_ANY_LAYOUT         27
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX     29
+
+// virtio 描述符个数，必须是 2 的幂
+#define NUM 8
+
+// 描述符
+struct virtq_desc {
+  uint64 addr;
+  uint32 len;
+  uint16 flags;
+  uint16 next;
+};
+#define VRING_DESC_F_NEXT  1 // 和下一个描述符串起来
+#define VRING_DESC_F_WRITE 2 // 设备写（否则是设备读）
+
+// avail 环：驱动告诉设备有哪些请求
+struct virtq_avail {
+  uint16 flags;     // VIRTQ_AVAIL_F_NO_INTERRUPT：完成时不要发中断
+  uint16 idx;       // 驱动下一次写 ring[idx % NUM]
+  uint16 ring[NUM]; // 请求链首描述符的编号
+  uint16 unused;
+};
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+// used 环：设备告诉驱动哪些请求完成了
+struct virtq_used_elem {
+  uint32 id;   // 完成的请求链首描述符的编号
+  uint32 len;
+};
+
+struct virtq_used {
+  uint16 flags; // 总是 0
+  uint16 idx;   // 设备加入新元素后递增
+  struct virtq_used_elem ring[NUM];
+};
+
+// 块设备请求：第一个描述符指向下面的请求头，
+// 第二个是数据，第三个是设备写回的一字节状态
+#define VIRTIO_BLK_T_IN  0 // 读磁盘
+#define VIRTIO_BLK_T_OUT 1 // 写磁盘
+
+struct virtio_blk_req {
+  uint32 type;     // VIRTIO_BLK_T_IN 或 ..._OUT
+  uint32 reserved;
+  uint64 sector;
+};
+
+#endif // VIRTIO_H
@@ -1,5 +1,185 @@
+// kernel/virtio_disk.c
+// virtio 块设备驱动（轮询方式），目前只给换页（swap.c）使用。
+// qemu 需要挂一块盘：
+//   -global virtio-mmio.force-legacy=false
+//   -drive file=swap.img,if=none,format=raw,id=x0
+//   -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// 一次只有一个请求在飞：提交后原地等 used 环前进，不依赖中断。
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include "kmem.h"
+#include "virtio.h"
+
+// 第 r 个 MMIO 寄存器的地址
+#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+
+static struct disk {
+  // 三个页：描述符表、avail 环、used 环（设备要求页对齐）
+  struct virtq_desc *desc;
+  struct virtq_avail *avail;
+  struct virtq_used *used;
+
+  uint16 used_idx;          // 已经处理到 used->ring 的哪一项
+
+  // 请求头和状态字节，设备通过物理地址访问
+  struct virtio_blk_req req;
+  volatile uint8 status;
+
+  uint64 capacity;          // 容量，单位 512 字节扇区
+  int ok;                   // 初始化成功
+  struct spinlock lock;
+} disk;
+
+// 探测并初始化 VIRTIO0 上的块设备。没有磁盘时返回 -1
+int
+virtio_disk_init(void)
+{
+  uint32 status = 0;
+
+  initlock(&disk.lock, "virtio_disk");
+
+  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+     *R(VIRTIO_MMIO_VERSION) != 2 ||
+     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
+     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
+    return -1;
+  }
+
+  // 复位设备
+  *R(VIRTIO_MMIO_STATUS) = status;
+
+  // 设置 ACKNOWLEDGE 位和 DRIVER 位
+  status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
+  *R(VIRTIO_MMIO_STATUS) = status;
+  status |= VIRTIO_CONFIG_S_DRIVER;
+  *R(VIRTIO_MMIO_STATUS) = status;
+
+  // 协商特性：这些我们都不用
+  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  features &= ~(1 << VIRTIO_BLK_F_RO);
+  features &= ~(1 << VIRTIO_BLK_F_SCSI);
+  features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
+  features &= ~(1 << VIRTIO_BLK_F_MQ);
+  features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
+  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
+  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+
+  status |= VIRTIO_CONFIG_S_FEATURES_OK;
+  *R(VIRTIO_MMIO_STATUS) = status;
+  if(!(*R(VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK)){
+    printf("virtio disk: FEATURES_OK unset\n");
+    return -1;
+  }
+
+  // 初始化 0 号队列
+  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
+  if(*R(VIRTIO_MMIO_QUEUE_READY)){
+    printf("virtio disk: queue 0 already in use\n");
+    return -1;
+  }
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max < NUM){
+    printf("virtio disk: queue 0 too short\n");
+    return -1;
+  }
+
+  // kalloc 返回的页已经清零
+  disk.desc = kalloc();
+  disk.avail = kalloc();
+  disk.used = kalloc();
+  if(!disk.desc || !disk.avail || !disk.used){
+    kfree(disk.desc);
+    kfree(disk.avail);
+    kfree(disk.used);
+    printf("virtio disk: out of memory\n");
+    return -1;
+  }
+
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
+  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // 轮询方式，完成时不需要中断
+  disk.avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+  status |= VIRTIO_CONFIG_S_DRIVER_OK;
+  *R(VIRTIO_MMIO_STATUS) = status;
+
+  // 块设备配置空间的第一个字段是容量（扇区数）
+  disk.capacity = *(volatile uint64 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG);
+  disk.ok = 1;
+  return 0;
+}
+
+// 磁盘容量（扇区数），没有磁盘时为 0
+uint64
+virtio_disk_capacity(void)
+{
+  return disk.ok ? disk.capacity : 0;
+}
+
+// 从 sector 开始读/写 len 字节（len 是 512 的倍数）。
+// buf 必须是内核恒等映射里的地址（即物理地址）。成功返回 0
+int
+virtio_disk_rw(uint64 sector, void *buf, uint32 len, int write)
+{
+  if(!disk.ok || (len % 512) != 0 || sector + len / 512 > disk.capacity)
+    return -1;
+
+  acquire(&disk.lock);
+
+  // 描述符 0：请求头；1：数据；2：状态字节
+  disk.req.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  disk.req.reserved = 0;
+  disk.req.sector = sector;
+
+  disk.desc[0].addr = (uint64)&disk.req;
+  disk.desc[0].len = sizeof(disk.req);
+  disk.desc[0].flags = VRING_DESC_F_NEXT;
+  disk.desc[0].next = 1;
+
+  disk.desc[1].addr = (uint64)buf;
+  disk.desc[1].len = len;
+  disk.desc[1].flags = (write ? 0 : VRING_DESC_F_WRITE) | VRING_DESC_F_NEXT;
+  disk.desc[1].next = 2;
+
+  disk.status = 0xff;       // 设备成功时写 0
+  disk.desc[2].addr = (uint64)&disk.status;
+  disk.desc[2].len = 1;
+  disk.desc[2].flags = VRING_DESC_F_WRITE;
+  disk.desc[2].next = 0;
+
+  // 把链首放进 avail 环，再通知设备
+  disk.avail->ring[disk.avail->idx % NUM] = 0;
+  __sync_synchronize();
+  disk.avail->idx += 1;
+  __sync_synchronize();
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+
+  // 等设备把请求放进 used 环
+  while(*(volatile uint16 *)&disk.used->idx == disk.used_idx)
+    ;
+  __sync_synchronize();
+  disk.used_idx += 1;
+
+  int ok = disk.status == 0;
+  release(&disk.lock);
+  return ok ? 0 : -1;
+}
+
 void virtio_disk_intr(void)
 {
-  // 这是一个占位函数，目前什么都不做
-  // 之后我们会在这里处理磁盘I/O完成事件
-}
\ No newline at end of file
+  // 我们关掉了完成中断；万一设备还是发了，确认一下就好
+  if(disk.ok)
+    *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+}
@@ -1,130 +1,899 @@
 // vm.c - simplified Sv39 page table helpers
 #include "vm.h"
+#include "param.h"
 #include "memlayout.h"
 #include "kmem.h"
 #include "riscv.h"
 #include "defs.h"
+#include "spinlock.h"
+#include "swap.h"
 #include <string.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define SATP_MODE_SV39 8UL
 
+
+#define PTE_LEAF_BITS (PTE_R | PTE_W | PTE_X)
+
+/* level_size: level 0 -> 4KB, level 1 -> 2MB, level 2 -> 1GB */
+static inline uint64_t level_size(int level) {
+    return 1UL << (PGSHIFT + 9 * level);
+}
+
+// page-table pages currently allocated by this file
+static uint64_t pagetable_pages = 0;
+
+static uint64_t huge_live = 0;      // huge (2MB) user leaves currently mapped
+static uint64_t huge_fallbacks = 0; // 2MB regions mapped with 4KB pages instead
+
+uint64_t vm_pagetable_pages(void) {
+    return __atomic_load_n(&pagetable_pages, __ATOMIC_RELAXED);
+}
+
 // allocate a zeroed page to be used as a pagetable page
 static pagetable_t alloc_pagetable_page(void) {
     void *p = kalloc();
     if (!p) return NULL;
     // kalloc already zeros page
+    kmem_page_set_state(p, PG_PAGETABLE);
+    __atomic_add_fetch(&pagetable_pages, 1, __ATOMIC_RELAXED);
     return (pagetable_t)p;
 }
 
+static void free_pagetable_page(void *page) {
+    __atomic_sub_fetch(&pagetable_pages, 1, __ATOMIC_RELAXED);
+    kfree(page);
+}
+
+// shared read-only page of zeros backing untouched lazy memory (pinned,
+// allocated by kvminit). it is never freed through a mapping.
+static void *zero_page = NULL;
+
+static inline int is_zero_page(uint64_t pa) {
+    return zero_page && pa == VA2PA(zero_page);
+}
+
+// ---- address-space registry (the page reclaim clock walks these) ----
+
+#define NVMSPACE 64
+
+static struct spinlock space_lock = { 0, "vm_space" };
+static struct spinlock reclaim_lock = { 0, "vm_reclaim" };
+static pagetable_t vm_spaces[NVMSPACE];
+
+// an address space that does not fit is simply never reclaimed from
+static void space_add(pagetable_t pt) {
+    acquire(&space_lock);
+    for (int i = 0; i < NVMSPACE; i++) {
+        if (vm_spaces[i] == NULL) {
+            vm_spaces[i] = pt;
+            break;
+        }
+    }
+    release(&space_lock);
+}
+
+// after this returns no reclaim pass is looking at pt
+static void space_remove(pagetable_t pt) {
+    acquire(&reclaim_lock);
+    acquire(&space_lock);
+    for (int i = 0; i < NVMSPACE; i++)
+        if (vm_spaces[i] == pt) vm_spaces[i] = NULL;
+    release(&space_lock);
+    release(&reclaim_lock);
+}
+
+// kvm_pagetable_create: an empty root (kernel_pagetable, and private
+// identity maps built for experiments)
+pagetable_t kvm_pagetable_create(void) {
+    return alloc_pagetable_page();
+}
+
+// proc_pagetable_create: a root for a new address space. the top-level
+// entries kvminit() built (marked PTE_G) are copied in by pointer, so the
+// kernel subtrees are shared by every address space rather than rebuilt,
+// and their TLB entries survive satp switches. the rest of the root is
+// empty. kernel slots are off limits to the user range operations: see
+// ptc_walk() and free_pagetable_recursive().
 pagetable_t proc_pagetable_create(void) {
     pagetable_t p = alloc_pagetable_page();
+    if (!p) return NULL;
+    if (kernel_pagetable) {
+        for (int i = 0; i < 512; i++)
+            if (kernel_pagetable[i] & PTE_G)
+                p[i] = kernel_pagetable[i];
+    }
+    space_add(p);
     return p;
 }
 
-//static void free_pagetable_page(void *page) {
-//    kfree(page);
-//}
+// ---- ASIDs ----
+//
+// Every page table installed in satp gets an ASID, so switching address
+// spaces does not flush the TLB and map/unmap only flush the VAs they
+// touched under that ASID. ASIDs are handed out from a bitmap and tagged
+// with a generation number (ctx = generation | asid). when the bitmap runs
+// out the generation is bumped: every hart flushes its TLB before it next
+// installs an ASID, and page tables still holding an old-generation ctx
+// get a fresh ASID on their next vm_switch(). ASIDs are not returned when
+// an address space is freed; the rollover recycles them.
+// ASID 0 belongs to kernel_pagetable. with no hardware ASID bits every
+// switch is a full flush, as before.
 
-// walk: return pointer to PTE for va; if alloc and missing, allocate intermediate page table pages
-pte_t *walk(pagetable_t pagetable, uint64_t va, int alloc) {
-    pte_t *pte;
-    pagetable_t p = pagetable;
-    for (int level = 2; level > 0; level--) {
-        uint64_t idx = vpn_index(va, level);
-        pte = &p[idx];
+#define ASID_MAX_BITS 16
+#define ASID_GEN_SHIFT ASID_MAX_BITS
+#define ASID_MASK ((1UL << ASID_GEN_SHIFT) - 1)
+#define NASIDCTX 64             // address spaces holding a ctx at once
+
+struct asid_ctx {
+    pagetable_t pt;             // NULL = unused slot
+    uint64_t ctx;               // generation | asid
+};
+
+struct asid_hart {
+    pagetable_t active;         // page table in satp
+    uint64_t ctx;               // its ctx (0 = kernel, or no ASID)
+    int flush_pending;          // a rollover happened since the last flush
+} __attribute__((aligned(64)));
+
+static struct spinlock asid_lock = { 0, "asid" };
+static int asid_bits = -1;      // -1 = not probed yet
+static uint64_t asid_gen = 1UL << ASID_GEN_SHIFT;
+static uint64_t asid_next = 1;
+static uint64_t asid_map[(1UL << ASID_MAX_BITS) / 64];
+static struct asid_ctx asid_ctxs[NASIDCTX];
+static struct asid_hart asid_harts[NCPU];
+static uint64_t asid_rollovers = 0;
+
+// probe how many ASID bits satp implements (writes all ones, reads back).
+static void asid_probe(uint64_t satp) {
+    w_satp(satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    uint64_t got = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    w_satp(satp);
+    int bits = 0;
+    while (bits < ASID_MAX_BITS && (got & (1UL << bits))) bits++;
+    asid_bits = bits;
+}
+
+static struct asid_ctx *asid_slot(pagetable_t pt) {
+    for (int i = 0; i < NASIDCTX; i++)
+        if (asid_ctxs[i].pt == pt) return &asid_ctxs[i];
+    return NULL;
+}
+
+// start a new generation: everything but the ASIDs active on some hart is
+// free again, and every hart owes a full flush. asid_lock held.
+static void asid_rollover(void) {
+    asid_gen += 1UL << ASID_GEN_SHIFT;
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1;            // ASID 0: kernel
+    asid_next = 1;
+    for (int h = 0; h < NCPU; h++) {
+        struct asid_hart *ah = &asid_harts[h];
+        ah->flush_pending = 1;
+        if (!ah->active || ah->ctx == 0) continue;
+        // keep ASIDs in use where they are, moved into the new generation
+        uint64_t asid = ah->ctx & ASID_MASK;
+        asid_map[asid / 64] |= 1UL << (asid % 64);
+        ah->ctx = asid_gen | asid;
+        struct asid_ctx *s = asid_slot(ah->active);
+        if (s) s->ctx = ah->ctx;
+    }
+    asid_rollovers++;
+}
+
+// ctx for pt in the current generation, allocating an ASID if needed.
+// returns 0 (shared, flush on every switch) when out of ctx slots.
+// asid_lock held.
+static uint64_t asid_get(pagetable_t pt) {
+    struct asid_ctx *s = asid_slot(pt);
+    if (s && (s->ctx & ~ASID_MASK) == asid_gen)
+        return s->ctx;
+    if (!s && (s = asid_slot(NULL)) == NULL)
+        return 0;
+
+    uint64_t nasid = 1UL << asid_bits;
+    uint64_t asid = 0;
+    for (int pass = 0; pass < 2 && !asid; pass++) {
+        for (uint64_t a = asid_next; a < nasid; a++) {
+            if (!(asid_map[a / 64] & (1UL << (a % 64)))) {
+                asid = a;
+                break;
+            }
+        }
+        if (!asid) asid_rollover();
+    }
+    if (!asid) {
+        // every ASID is active on some hart
+        s->pt = NULL;
+        return 0;
+    }
+    asid_map[asid / 64] |= 1UL << (asid % 64);
+    asid_next = asid + 1;
+    s->pt = pt;
+    s->ctx = asid_gen | asid;
+    return s->ctx;
+}
+
+// forget pt's ctx (freevm). its ASID stays taken until the next rollover,
+// so no TLB entry of pt can be hit by a new owner of that ASID.
+static void asid_release(pagetable_t pt) {
+    acquire(&asid_lock);
+    struct asid_ctx *s = asid_slot(pt);
+    if (s) s->pt = NULL;
+    release(&asid_lock);
+}
+
+// vm_switch: make pagetable the active address space on this hart.
+void vm_switch(pagetable_t pagetable) {
+    int intr = intr_save();
+    struct asid_hart *ah = &asid_harts[cpuid()];
+    uint64_t ctx = 0;
+    int shared = 0;
+    if (asid_bits > 0) {
+        acquire(&asid_lock);
+        ctx = pagetable == kernel_pagetable ? 0 : asid_get(pagetable);
+        // pages of two different address spaces under ASID 0
+        shared = (ctx == 0 && pagetable != kernel_pagetable) ||
+                 (ah->ctx == 0 && ah->active != kernel_pagetable && ah->active != pagetable);
+        int flush = ah->flush_pending;
+        ah->flush_pending = 0;
+        ah->active = pagetable;
+        ah->ctx = ctx;
+        release(&asid_lock);
+        w_satp(MAKE_SATP_ASID(VA2PA(pagetable), ctx & ASID_MASK));
+        if (flush || shared) sfence_vma();
+    } else {
+        ah->active = pagetable;
+        w_satp(MAKE_SATP(VA2PA(pagetable)));
+        sfence_vma();
+    }
+    intr_restore(intr);
+}
+
+// vm_flush_range: PTEs for [va, va+size) of pagetable changed; `tables`
+// says page-table pages were unlinked too. flushes only that ASID, and
+// nothing at all for a page table that never held one (it was never in
+// satp, so no TLB can hold its translations). only the local hart's TLB
+// is flushed, like sfence_vma() before it.
+void vm_flush_range(pagetable_t pagetable, uint64_t va, uint64_t size, int tables) {
+    if (size == 0 && !tables) return;
+    if (asid_bits <= 0) {
+        sfence_vma();
+        return;
+    }
+    if (pagetable == kernel_pagetable) {
+        // kernel mappings are global: an ASID flush would not drop them
+        if (tables || size > VM_FLUSH_PAGES * PGSIZE) {
+            sfence_vma();
+            return;
+        }
+        for (uint64_t a = va & ~(PGSIZE - 1); a < va + size; a += PGSIZE)
+            sfence_vma_va(a);
+        return;
+    }
+    acquire(&asid_lock);
+    struct asid_ctx *s = asid_slot(pagetable);
+    int active = 0;
+    for (int h = 0; h < NCPU; h++)
+        active |= asid_harts[h].active == pagetable;
+    int none = !s && !active;
+    uint64_t asid = s ? (s->ctx & ASID_MASK) : 0;
+    release(&asid_lock);
+    if (none) return;
+    if (tables || size > VM_FLUSH_PAGES * PGSIZE) {
+        sfence_vma_asid(asid);
+        return;
+    }
+    for (uint64_t a = va & ~(PGSIZE - 1); a < va + size; a += PGSIZE)
+        sfence_vma_page(a, asid);
+}
+
+uint64_t vm_asid_rollovers(void) {
+    return __atomic_load_n(&asid_rollovers, __ATOMIC_RELAXED);
+}
+
+// ---- page-table range cursor ----
+//
+// A pt_cursor remembers the level-1 and level-0 tables of its last lookup,
+// so visiting consecutive VAs only re-walks from the root when the VA leaves
+// the 2MB (level-0 table) or 1GB (level-1 table) span it is sitting on.
+// With prune set, a cached table that is left empty when the cursor moves
+// off it is unlinked and freed; the pages queued for freeing are released
+// after a TLB flush, by ptc_finish() or when the queue fills up.
+// The cursor collects the VA range whose PTEs changed, so the flush only
+// covers those pages (see vm_flush_range()).
+
+void ptc_init(struct pt_cursor *c, pagetable_t root, int prune) {
+    c->root = root;
+    c->tbl[0] = c->tbl[1] = NULL;
+    c->prune = prune;
+    c->flo = ~0UL;
+    c->fhi = 0;
+    c->ftables = 0;
+    c->nfree = 0;
+}
+
+// note that the PTEs for [va, va+size) changed.
+static inline void ptc_dirty(struct pt_cursor *c, uint64_t va, uint64_t size) {
+    if (va < c->flo) c->flo = va;
+    if (va + size > c->fhi) c->fhi = va + size;
+}
+
+static void ptc_flush(struct pt_cursor *c) {
+    if (c->flo < c->fhi || c->ftables)
+        vm_flush_range(c->root, c->flo < c->fhi ? c->flo : 0,
+                       c->flo < c->fhi ? c->fhi - c->flo : 0, c->ftables);
+    c->flo = ~0UL;
+    c->fhi = 0;
+    c->ftables = 0;
+}
+
+// queue a page to be freed once no TLB entry can still reach it.
+static void ptc_free_later(struct pt_cursor *c, void *page) {
+    c->freeq[c->nfree++] = page;
+    if (c->nfree == PTC_FREEQ) {
+        ptc_flush(c);
+        kfree_batch(c->freeq, c->nfree);
+        c->nfree = 0;
+    }
+}
+
+// free cached table tbl[l] if it no longer maps anything.
+static void ptc_prune(struct pt_cursor *c, int l) {
+    pagetable_t t = c->tbl[l];
+    for (int i = 0; i < 512; i++) {
+        if (t[i]) return;
+    }
+    *c->ppte[l] = 0;
+    c->ftables = 1;
+    __atomic_sub_fetch(&pagetable_pages, 1, __ATOMIC_RELAXED);
+    ptc_free_later(c, t);
+}
+
+// ptc_walk: like walk_level(), but starts from the lowest cached table
+// that covers va. returns NULL when nothing is mapped there (and !alloc):
+// *leaf_level is then the level of the empty slot, so the caller can skip
+// level_size(*leaf_level) bytes at once.
+pte_t *ptc_walk(struct pt_cursor *c, uint64_t va, int level, int alloc, int *leaf_level) {
+    // drop cached tables that do not cover va (level 0 first, so a pruned
+    // level-0 table can leave its level-1 parent empty in turn)
+    for (int l = 0; l < 2; l++) {
+        if (c->tbl[l] && c->tag[l] != (va >> (PGSHIFT + 9 * (l + 1)))) {
+            if (c->prune) ptc_prune(c, l);
+            c->tbl[l] = NULL;
+        }
+    }
+
+    int l = 2;
+    pagetable_t p = c->root;
+    for (int k = level; k < 2; k++) {
+        if (c->tbl[k]) {
+            l = k;
+            p = c->tbl[k];
+            break;
+        }
+    }
+
+    for (; l > level; l--) {
+        pte_t *pte = &p[vpn_index(va, l)];
+        if (l == 2 && (*pte & PTE_G) && c->root != kernel_pagetable) {
+            // a shared kernel slot: not part of this address space's own
+            // mappings, never changed or freed through it
+            *leaf_level = l;
+            return NULL;
+        }
         if (*pte & PTE_V) {
+            if (*pte & PTE_LEAF_BITS) {
+                // superpage leaf: nothing below it
+                *leaf_level = l;
+                return pte;
+            }
             // non-leaf -> next level: extract next page physical address
-            uint64_t next_pa = pte_to_pa(*pte);
-            p = (pagetable_t)PA2VA(next_pa);
+            p = (pagetable_t)PA2VA(pte_to_pa(*pte));
         } else {
-            if (!alloc) return NULL;
+            if (!alloc) {
+                *leaf_level = l;
+                return NULL;
+            }
             pagetable_t newpage = alloc_pagetable_page();
-            if (!newpage) return NULL;
+            if (!newpage) {
+                *leaf_level = l;
+                return NULL;
+            }
             // link it in: mark valid and point to it
-            uint64_t newpa = VA2PA(newpage);
-            *pte = pa_to_pte(newpa, PTE_V);
+            *pte = pa_to_pte(VA2PA(newpage), PTE_V);
             p = newpage;
         }
+        c->tbl[l - 1] = p;
+        c->tag[l - 1] = va >> (PGSHIFT + 9 * l);
+        c->ppte[l - 1] = pte;
     }
-    // level 0
-    uint64_t idx0 = vpn_index(va, 0);
-    return &p[idx0];
+    *leaf_level = level;
+    return &p[vpn_index(va, level)];
 }
 
-// mappages: map [va, va+size) to [pa, pa+size)
-int mappages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, int perm) {
+// ptc_next: find the first valid leaf or swap entry (level 0, PTE_V
+// clear; see swap.h) in [*va, end). on success *va is the address it was
+// found at (inside the leaf for superpages) and *level the leaf's level.
+// unmapped 2MB/1GB slots are skipped in one step.
+pte_t *ptc_next(struct pt_cursor *c, uint64_t *va, uint64_t end, int *level) {
+    uint64_t a = *va;
+    while (a < end) {
+        int l;
+        pte_t *pte = ptc_walk(c, a, 0, 0, &l);
+        if (pte && ((*pte & PTE_V) || PTE_IS_SWAP(*pte))) {
+            *va = a;
+            *level = l;
+            return pte;
+        }
+        uint64_t next = (a | (level_size(l) - 1)) + 1;
+        if (next <= a) break;   // wrapped at the top of the address space
+        a = next;
+    }
+    *va = end;
+    return NULL;
+}
+
+// ptc_map: install a 4KB leaf for va. fails if out of memory or if
+// something is already mapped there.
+int ptc_map(struct pt_cursor *c, uint64_t va, uint64_t pa, int perm) {
+    int got;
+    pte_t *pte = ptc_walk(c, va, 0, 1, &got);
+    if (!pte || got != 0 || (*pte & PTE_V)) return -1;
+    *pte = pa_to_pte(pa, perm | PTE_V);
+    ptc_dirty(c, va, PGSIZE);
+    return 0;
+}
+
+// ptc_finish: prune what is still cached, flush the changed part of the
+// TLB and free the queued pages. the cursor may be reused afterwards.
+void ptc_finish(struct pt_cursor *c) {
+    for (int l = 0; l < 2; l++) {
+        if (c->tbl[l] && c->prune) ptc_prune(c, l);
+        c->tbl[l] = NULL;
+    }
+    ptc_flush(c);
+    kfree_batch(c->freeq, c->nfree);
+    c->nfree = 0;
+}
+
+// walk_level: return pointer to the PTE for va at `level` (0 = 4KB slot,
+// 1 = 2MB slot, 2 = 1GB slot); if alloc and missing, allocate intermediate
+// page table pages. a large leaf found above `level` is returned instead,
+// and *leaf_level (if not NULL) says which level the returned PTE is at.
+pte_t *walk_level(pagetable_t pagetable, uint64_t va, int level, int alloc, int *leaf_level) {
+    struct pt_cursor c;
+    int l;
+    ptc_init(&c, pagetable, 0);
+    pte_t *pte = ptc_walk(&c, va, level, alloc, &l);
+    if (pte && leaf_level) *leaf_level = l;
+    return pte;
+}
+
+// walk: return pointer to the leaf PTE for va (a level-0 slot, or the
+// superpage leaf covering va); if alloc and missing, allocate intermediate
+// page table pages
+pte_t *walk(pagetable_t pagetable, uint64_t va, int alloc) {
+    return walk_level(pagetable, va, 0, alloc, NULL);
+}
+
+// mappages_level: map [va, va+size) to [pa, pa+size), using leaves up to
+// `maxlevel` (1 = 2MB, 2 = 1GB) wherever va, pa and the remaining size are
+// aligned for them, and 4KB leaves elsewhere.
+int mappages_level(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, int perm, int maxlevel) {
     uint64_t a = va & ~(PGSIZE - 1);
-    uint64_t last = ((va + size - 1) & ~(PGSIZE - 1));
-    for (; a <= last; a += PGSIZE, pa += PGSIZE) {
-        pte_t *pte = walk(pagetable, a, 1);
-        if (!pte) return -1;
-        if (*pte & PTE_V) {
-            // already mapped
-            return -1;
+    uint64_t end = ((va + size - 1) & ~(PGSIZE - 1)) + PGSIZE;
+    if (size == 0) return 0;
+    struct pt_cursor c;
+    ptc_init(&c, pagetable, 0);
+    int ret = 0;
+    while (a < end) {
+        int level = maxlevel;
+        while (level > 0 &&
+               (((a | pa) & (level_size(level) - 1)) != 0 || end - a < level_size(level)))
+            level--;
+        pte_t *pte;
+        int got;
+        for (;;) {
+            pte = ptc_walk(&c, a, level, 1, &got);
+            // a table already hangs here (some smaller mappings nearby):
+            // fall back to the next smaller leaf size
+            if (pte && level > 0 && got == level &&
+                (*pte & PTE_V) && !(*pte & PTE_LEAF_BITS)) {
+                level--;
+                continue;
+            }
+            break;
+        }
+        if (!pte || got != level || (*pte & PTE_V)) {
+            // out of memory, or already mapped
+            ret = -1;
+            break;
         }
         *pte = pa_to_pte(pa, perm | PTE_V);
+        ptc_dirty(&c, a, level_size(level));
+        a += level_size(level);
+        pa += level_size(level);
     }
     // after mapping, flush TLB for safety in current hart
-    sfence_vma();
+    ptc_finish(&c);
+    return ret;
+}
+
+// mappages: map [va, va+size) to [pa, pa+size) with 4KB leaves
+int mappages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, int perm) {
+    return mappages_level(pagetable, va, size, pa, perm, 0);
+}
+
+// split the superpage leaf *pte at `level` into a table of 512 leaves one
+// level down with the same permissions. an allocator-backed 2MB block is
+// turned into 512 independently freeable pages at the same time.
+// no TLB flush: a cached superpage entry still translates exactly like the
+// new leaves, and the flush for whatever the caller changes next (by VA)
+// also drops the superpage entry covering that VA.
+static int split_leaf(pte_t *pte, int level) {
+    pagetable_t t = alloc_pagetable_page();
+    if (!t) return -1;
+    uint64_t pa = pte_to_pa(*pte);
+    // (a kernel superpage is never split, so the table needs no PTE_G)
+    uint64_t flags = *pte & 0x3FF;
+    uint64_t step = level_size(level - 1);
+    for (int i = 0; i < 512; i++)
+        t[i] = pa_to_pte(pa + i * step, flags);
+    if (level == 1 && kmem_page_state(PA2VA(pa)) == PG_ALLOC) {
+        kmem_split_pages(PA2VA(pa), 9);
+        __atomic_sub_fetch(&huge_live, 1, __ATOMIC_RELAXED);
+    }
+    *pte = pa_to_pte(VA2PA(t), PTE_V);
     return 0;
 }
 
-// unmap pages and free the physical pages mapped
+// wait out an eviction in progress on another hart: evict_page() leaves a
+// SWAP_BUSY marker in the PTE while swap_out() runs, then replaces it with
+// the swap entry (or the old mapping if no tier took the page).
+static pte_t pte_settle(pte_t *pte) {
+    pte_t v;
+    while (PTE_IS_SWAP_BUSY(v = __atomic_load_n(pte, __ATOMIC_ACQUIRE)))
+        ;
+    return v;
+}
+
+// unmap pages and free the physical pages mapped, along with any page-table
+// pages the unmapping leaves empty.
+// a superpage leaf entirely inside the range is dropped as a whole (and its
+// 2MB block freed); one straddling an edge of the range is split first.
 void unmap_pages(pagetable_t pagetable, uint64_t va, uint64_t size) {
+    if (size == 0) return;
+    struct pt_cursor c;
+    ptc_init(&c, pagetable, 1);
     uint64_t a = va & ~(PGSIZE - 1);
-    uint64_t last = ((va + size - 1) & ~(PGSIZE - 1));
-    for (; a <= last; a += PGSIZE) {
-        pte_t *pte = walk(pagetable, a, 0);
-        if (!pte) continue;
-        if (!(*pte & PTE_V)) continue;
+    uint64_t end = ((va + size - 1) & ~(PGSIZE - 1)) + PGSIZE;
+    int level;
+    pte_t *pte;
+    while ((pte = ptc_next(&c, &a, end, &level)) != NULL) {
+        pte_settle(pte);
+        if (level > 0) {
+            uint64_t lsz = level_size(level);
+            if ((a & (lsz - 1)) != 0 || end - a < lsz) {
+                if (split_leaf(pte, level) != 0)
+                    panic("unmap_pages: split");
+                continue;   // look again, now one level down
+            }
+            uint64_t pa = pte_to_pa(*pte);
+            *pte = 0;
+            ptc_dirty(&c, a, lsz);
+            // 1GB leaves are never allocator-backed (buddy blocks stop at
+            // KMEM_MAX_ORDER); they only ever map fixed physical memory
+            if (9 * level <= KMEM_MAX_ORDER) {
+                ptc_flush(&c);
+                kfree_pages(PA2VA(pa), 9 * level);
+                __atomic_sub_fetch(&huge_live, 1, __ATOMIC_RELAXED);
+            }
+            a += lsz;
+            continue;
+        }
+        if (PTE_IS_SWAP(*pte)) {
+            // swapped out: only the stored copy to give back
+            swap_free(*pte);
+            *pte = 0;
+            a += PGSIZE;
+            continue;
+        }
         uint64_t pa = pte_to_pa(*pte);
         // clear entry
         *pte = 0;
-        kfree((void *)PA2VA(pa));
+        ptc_dirty(&c, a, PGSIZE);
+        if (!is_zero_page(pa))
+            ptc_free_later(&c, PA2VA(pa));
+        a += PGSIZE;
     }
-    sfence_vma();
+    ptc_finish(&c);
 }
 
 // walkaddr: return physical address for va (or 0 if not mapped)
 uint64_t walkaddr(pagetable_t pagetable, uint64_t va) {
-    pte_t *pte = walk(pagetable, va, 0);
+    int level;
+    pte_t *pte = walk_level(pagetable, va, 0, 0, &level);
     if (!pte) return 0;
     if (!(*pte & PTE_V)) return 0;
     // must be leaf (R/W/X bits indicate leaf)
-    if (!((*pte & PTE_R) || (*pte & PTE_X) || (*pte & PTE_W))) return 0;
-    return pte_to_pa(*pte) | (va & (PGSIZE - 1));
+    if (!(*pte & PTE_LEAF_BITS)) return 0;
+    return pte_to_pa(*pte) | (va & (level_size(level) - 1));
+}
+
+// a page for user memory; under memory pressure reclaim some first, and
+// while the allocator still comes back empty, reclaim again for as long as
+// that makes progress (pages stored in the compressed pool cost pool pages,
+// so one round may free nothing the allocator can hand out)
+static void *alloc_user_page(int zero) {
+    vm_reclaim_check();
+    void *mem;
+    while ((mem = zero ? kalloc() : kalloc_nozero()) == NULL &&
+           vm_reclaim(VM_RECLAIM_BATCH) > 0)
+        ;
+    return mem;
+}
+
+// ---- lazy (demand-paged) allocation ----
+//
+// uvmalloc_lazy() only records the grown range [start, end) for the page
+// table; nothing is mapped. the first load from a page there maps the
+// shared zero page read-only (PTE_COW), the first store maps a fresh zeroed
+// page, and a later store to a zero-page mapping goes through the COW path.
+// there is no process structure to hang the range on yet, so the ranges
+// live in a small table keyed by root page table.
+
+#define NLAZY 32
+
+struct lazy_range {
+    pagetable_t pt;         // NULL = unused slot
+    uint64_t start, end;
+};
+
+static struct spinlock lazy_lock = { 0, "vm_lazy" };
+static struct lazy_range lazy_ranges[NLAZY];
+static uint64_t lazy_faults = 0;    // faults that mapped something in a lazy range
+static uint64_t lazy_zero_hits = 0; // ... of which were served by the zero page
+
+// record [start, end) as lazy for pt, extending a range that ends at start.
+static int lazy_add(pagetable_t pt, uint64_t start, uint64_t end) {
+    int ret = -1;
+    acquire(&lazy_lock);
+    for (int i = 0; i < NLAZY; i++) {
+        if (lazy_ranges[i].pt == pt && lazy_ranges[i].end == start) {
+            lazy_ranges[i].end = end;
+            ret = 0;
+            break;
+        }
+    }
+    for (int i = 0; ret != 0 && i < NLAZY; i++) {
+        if (lazy_ranges[i].pt == NULL) {
+            lazy_ranges[i].pt = pt;
+            lazy_ranges[i].start = start;
+            lazy_ranges[i].end = end;
+            ret = 0;
+        }
+    }
+    release(&lazy_lock);
+    return ret;
+}
+
+// forget the lazy parts of pt at or above `from` (0 = all of them).
+static void lazy_drop(pagetable_t pt, uint64_t from) {
+    acquire(&lazy_lock);
+    for (int i = 0; i < NLAZY; i++) {
+        struct lazy_range *r = &lazy_ranges[i];
+        if (r->pt != pt || r->end <= from) continue;
+        if (r->start >= from) r->pt = NULL;
+        else r->end = from;
+    }
+    release(&lazy_lock);
+}
+
+static int lazy_contains(pagetable_t pt, uint64_t va) {
+    int found = 0;
+    acquire(&lazy_lock);
+    for (int i = 0; i < NLAZY && !found; i++) {
+        struct lazy_range *r = &lazy_ranges[i];
+        found = (r->pt == pt && va >= r->start && va < r->end);
+    }
+    release(&lazy_lock);
+    return found;
+}
+
+// give new the lazy ranges old has below sz (for copyuvm / copyuvm_cow).
+static int lazy_copy(pagetable_t old, pagetable_t new, uint64_t sz) {
+    struct lazy_range r;
+    for (int i = 0; i < NLAZY; i++) {
+        acquire(&lazy_lock);
+        r = lazy_ranges[i];
+        release(&lazy_lock);
+        if (r.pt != old || r.start >= sz) continue;
+        if (lazy_add(new, r.start, r.end < sz ? r.end : sz) != 0) {
+            lazy_drop(new, 0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// uvmalloc_lazy: grow from oldsz to newsz without allocating anything.
+// falls back to uvmalloc() when the range table is full.
+int uvmalloc_lazy(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz) {
+    if (newsz < oldsz) return -1;
+    uint64_t start = (oldsz + PGSIZE - 1) & ~(PGSIZE - 1);
+    uint64_t end = newsz & ~(PGSIZE - 1);
+    if (end <= start) return 0;
+    // the range must not reach into a shared kernel slot
+    for (uint64_t s = vpn_index(start, 2); s <= vpn_index(end - 1, 2); s++)
+        if (pagetable[s] & PTE_G) return -1;
+    if (lazy_add(pagetable, start, end) != 0)
+        return uvmalloc(pagetable, oldsz, newsz);
+    return 0;
+}
+
+// vm_lazy_fault: first touch of an unmapped page in a lazy range. returns
+// 0 if handled, -1 if va is not lazy or memory ran out.
+int vm_lazy_fault(pagetable_t pagetable, uint64_t va, int write) {
+    va &= ~(PGSIZE - 1);
+    if (!lazy_contains(pagetable, va)) return -1;
+    pte_t *pte = walk(pagetable, va, 1);
+    if (!pte) return -1;
+    pte_t old = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+    if (old & PTE_V) {
+        // another hart got here first and the access is now allowed: retry
+        // it. otherwise this was a permission fault on a mapped page
+        // (e.g. a store to a read-only page that is not COW)
+        return (old & (write ? PTE_W : PTE_R)) ? 0 : -1;
+    }
+    // a swap entry (possibly one still being written out) is vm_fault()'s
+    // to bring back; retry the access through it
+    if (old != 0) return PTE_IS_SWAP(old) ? 0 : -1;
+    void *mem = NULL;
+    pte_t new;
+    if (write) {
+        // (reclaim never frees page-table pages, so pte stays good)
+        mem = alloc_user_page(1);
+        if (!mem) return -1;
+        new = pa_to_pte(VA2PA(mem), PTE_R | PTE_W | PTE_U | PTE_A | PTE_V);
+    } else {
+        new = pa_to_pte(VA2PA(zero_page), PTE_R | PTE_U | PTE_COW | PTE_V);
+    }
+    // install only over the empty slot we saw: two harts faulting on the
+    // same page both get here, and the loser drops its page and retries
+    // the access through the winner's mapping
+    if (!__atomic_compare_exchange_n(pte, &old, new, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (mem) kfree(mem);
+        return 0;
+    }
+    if (!write)
+        __atomic_add_fetch(&lazy_zero_hits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lazy_faults, 1, __ATOMIC_RELAXED);
+    vm_flush_range(pagetable, va, PGSIZE, 0);
+    return 0;
+}
+
+// vm_resident_pages: private pages mapped in [0, sz) (zero-page mappings
+// are not counted).
+uint64_t vm_resident_pages(pagetable_t pagetable, uint64_t sz) {
+    struct pt_cursor c;
+    ptc_init(&c, pagetable, 0);
+    uint64_t va = 0, n = 0;
+    int level;
+    pte_t *pte;
+    while ((pte = ptc_next(&c, &va, sz, &level)) != NULL) {
+        uint64_t lsz = level_size(level);
+        if ((*pte & PTE_V) && !is_zero_page(pte_to_pa(*pte)))
+            n += lsz / PGSIZE;
+        va = (va & ~(lsz - 1)) + lsz;
+    }
+    return n;
+}
+
+void vm_lazy_stats(uint64_t *faults, uint64_t *zero_hits) {
+    if (faults) *faults = __atomic_load_n(&lazy_faults, __ATOMIC_RELAXED);
+    if (zero_hits) *zero_hits = __atomic_load_n(&lazy_zero_hits, __ATOMIC_RELAXED);
+}
+
+// ---- transparent huge pages ----
+//
+// user memory growth that covers a whole aligned 2MB region is backed by
+// one order-9 block under a single level-1 leaf. when no such block is
+// free (or something already hangs in that slot) the region is mapped
+// with 4KB pages instead. a huge leaf is dropped whole by unmap_pages(),
+// split into 512 pages when only part of it goes away or it is shared
+// copy-on-write, and copied whole by copyuvm() when memory allows.
+
+#define HUGE_SIZE (1UL << (PGSHIFT + 9))
+#define HUGE_ORDER 9
+
+// map a fresh 2MB block at va (2MB aligned) through c: a copy of src, or
+// zeroed if src is NULL. returns 0 on success, 1 if the caller should use
+// 4KB pages instead (counted as a fallback). the block is only tried for:
+// draining the page caches and the pre-zeroed pool to build one under
+// memory pressure would throw that work away for every 2MB step.
+static int map_huge(struct pt_cursor *c, uint64_t va, int perm, void *src) {
+    int got;
+    pte_t *pte = ptc_walk(c, va, 1, 1, &got);
+    void *mem = NULL;
+    if (pte && got == 1 && *pte == 0)
+        mem = kalloc_pages_try(HUGE_ORDER, src == NULL);
+    if (!mem) {
+        __atomic_add_fetch(&huge_fallbacks, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    if (src) memcpy(mem, src, HUGE_SIZE);
+    *pte = pa_to_pte(VA2PA(mem), perm | PTE_V);
+    ptc_dirty(c, va, HUGE_SIZE);
+    __atomic_add_fetch(&huge_live, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void vm_huge_stats(uint64_t *live, uint64_t *fallbacks) {
+    if (live) *live = __atomic_load_n(&huge_live, __ATOMIC_RELAXED);
+    if (fallbacks) *fallbacks = __atomic_load_n(&huge_fallbacks, __ATOMIC_RELAXED);
 }
 
 // uvmalloc: allocate pages to grow from oldsz to newsz (both bytes)
+// aligned 2MB regions get a huge page if one is available; other pages are
+// taken from the allocator VM_BATCH at a time.
 int uvmalloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz) {
     if (newsz < oldsz) return -1;
-    uint64_t a = (oldsz + PGSIZE - 1) & ~(PGSIZE - 1);
-    for (; a + PGSIZE <= newsz; a += PGSIZE) {
-        void *mem = kalloc();
-        if (!mem) {
-            // allocation failure: rollback previously allocated pages
-            unmap_pages(pagetable, (oldsz + PGSIZE - 1) & ~(PGSIZE - 1), a - ((oldsz + PGSIZE - 1) & ~(PGSIZE - 1)));
-            return -1;
+    uint64_t start = (oldsz + PGSIZE - 1) & ~(PGSIZE - 1);
+    uint64_t a = start;
+    void *batch[VM_BATCH];
+    struct pt_cursor c;
+    ptc_init(&c, pagetable, 0);
+    while (a + PGSIZE <= newsz) {
+        vm_reclaim_check();
+        if ((a & (HUGE_SIZE - 1)) == 0 && newsz - a >= HUGE_SIZE &&
+            map_huge(&c, a, PTE_R | PTE_W | PTE_U, NULL) == 0) {
+            a += HUGE_SIZE;
+            continue;
         }
-        uint64_t pa = VA2PA(mem);
-        if (mappages(pagetable, a, PGSIZE, pa, PTE_R | PTE_W | PTE_U) != 0) {
-            kfree(mem);
-            unmap_pages(pagetable, (oldsz + PGSIZE - 1) & ~(PGSIZE - 1), a - ((oldsz + PGSIZE - 1) & ~(PGSIZE - 1)));
-            return -1;
+        uint64_t left = (newsz - a) / PGSIZE;
+        // stop at the next 2MB boundary if a huge page could start there
+        uint64_t next = (a | (HUGE_SIZE - 1)) + 1;
+        if (next - a < left * PGSIZE && newsz - next >= HUGE_SIZE)
+            left = (next - a) / PGSIZE;
+        int want = left < VM_BATCH ? (int)left : VM_BATCH;
+        int got = kalloc_batch(want, batch);
+        if (got == 0) {
+            // out of memory: swap pages out and go round again. reclaim
+            // often frees fewer pages than asked (pages stored in the
+            // compressed pool cost pool pages), so whatever a round yields
+            // is mapped; give up only once reclaim stops making progress
+            if (vm_reclaim(want) > 0) continue;
+            goto fail;
+        }
+        for (int i = 0; i < got; i++, a += PGSIZE) {
+            // new pages start referenced: one clock pass of grace
+            if (ptc_map(&c, a, VA2PA(batch[i]), PTE_R | PTE_W | PTE_U | PTE_A) != 0) {
+                kfree_batch(&batch[i], got - i);
+                goto fail;
+            }
         }
     }
+    ptc_finish(&c);
     return 0;
+
+fail:
+    // allocation failure: rollback previously allocated pages
+    ptc_finish(&c);
+    unmap_pages(pagetable, start, a - start);
+    return -1;
 }
 
 void uvmdealloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz) {
     if (newsz >= oldsz) return;
     uint64_t a = ((newsz + PGSIZE - 1) & ~(PGSIZE - 1));
-    for (; a + PGSIZE <= oldsz; a += PGSIZE) {
-        // unmap_pages will free the physical page
-        unmap_pages(pagetable, a, PGSIZE);
-    }
+    lazy_drop(pagetable, a);
+    uint64_t last = oldsz & ~(PGSIZE - 1);
+    // unmap_pages will free the physical pages (whole pages below oldsz)
+    if (last > a)
+        unmap_pages(pagetable, a, last - a);
 }
 
 // helper to walk pagetable recursively and free page-table pages and leaf pages
@@ -132,6 +901,8 @@ static void free_pagetable_recursive(pagetable_t p, int level) {
     if (!p) return;
     for (int i = 0; i < 512; i++) {
         pte_t ent = p[i];
+        // 共享的内核页表（PTE_G）不属于这个地址空间，不能释放
+        if (ent & PTE_G) continue;
         // 只关心指向下一级页表的PTE，忽略叶子PTE
         if ((ent & PTE_V) && (ent & (PTE_R | PTE_W | PTE_X)) == 0) {
             // non-leaf -> recurse
@@ -142,49 +913,522 @@ static void free_pagetable_recursive(pagetable_t p, int level) {
         }
     }
     // free this page table page itself
-    kfree((void *)p);
+    free_pagetable_page((void *)p);
 }
 
 void freevm(pagetable_t pagetable, uint64_t sz) {
     if (!pagetable) return;
-    // free all mapped pages and page-table pages
+    lazy_drop(pagetable, 0);
+    // free the user pages in [0, sz) (batched through unmap_pages, which
+    // also drops the tables it empties), then the remaining page-table pages
+    unmap_pages(pagetable, 0, sz);
+    // nothing may still walk the tables we are about to free
+    vm_flush_range(pagetable, 0, 0, 1);
+    asid_release(pagetable);
+    space_remove(pagetable);
     free_pagetable_recursive(pagetable, 2);
 }
 
 // copyuvm: copy user memory from old pagetable into a newly allocated pagetable
+// present pages are gathered VM_BATCH at a time (holes are skipped a whole
+// table at a time) and their copies allocated with one kalloc_batch_nozero()
+// call per group. a huge leaf is copied into a huge leaf if a 2MB block is
+// free, otherwise 4KB at a time.
 pagetable_t copyuvm(pagetable_t old, uint64_t sz) {
     pagetable_t new = proc_pagetable_create();
     if (!new) return NULL;
-    // walk each page in user space and copy
-    for (uint64_t i = 0; i < sz; i += PGSIZE) {
-        uint64_t pa = walkaddr(old, i);
-        if (pa == 0) {
-            // page not present -> skip (sparse)
-            continue;
+    if (lazy_copy(old, new, sz) != 0) {
+        freevm(new, 0);
+        return NULL;
+    }
+    uint64_t vas[VM_BATCH];
+    uint64_t pas[VM_BATCH];
+    void *mem[VM_BATCH];
+    struct pt_cursor src, dst;
+    ptc_init(&src, old, 0);
+    ptc_init(&dst, new, 0);
+    uint64_t i = 0;
+    uint64_t nohuge = ~0UL;     // huge leaf being copied 4KB at a time
+    while (i < sz) {
+        int n = 0;
+        int level;
+        pte_t *pte;
+        while (n < VM_BATCH && (pte = ptc_next(&src, &i, sz, &level)) != NULL) {
+            pte_settle(pte);
+            if (level == 1 && (i & (HUGE_SIZE - 1)) == 0 && sz - i >= HUGE_SIZE &&
+                i != nohuge) {
+                if (n > 0) break;   // map the pending 4KB copies first
+                if (map_huge(&dst, i, PTE_R | PTE_W | PTE_U, PA2VA(pte_to_pa(*pte))) == 0) {
+                    i += HUGE_SIZE;
+                    continue;
+                }
+                nohuge = i;
+            }
+            // other superpage leaves are copied 4KB at a time; a swapped-out
+            // page is read straight from its swap entry (which, unlike a
+            // page address, has PTE_SWAP set)
+            uint64_t off = i & (level_size(level) - 1) & ~(PGSIZE - 1);
+            vas[n] = i & ~(PGSIZE - 1);
+            if (PTE_IS_SWAP(*pte))
+                pas[n] = *pte;
+            else
+                pas[n] = pte_to_pa(*pte) + off;
+            n++;
+            i = (i & ~(PGSIZE - 1)) + PGSIZE;
         }
-        void *mem = kalloc();
-        if (!mem) {
+        if (n == 0) break;
+
+        // the whole page is overwritten by the copy below
+        int got = kalloc_batch_nozero(n, mem);
+        if (got < n) {
             // allocation fail -> cleanup
-            freevm(new, i);
+            kfree_batch(mem, got);
+            ptc_finish(&dst);
+            freevm(new, sz);
             return NULL;
         }
-        // copy content
-        memcpy(mem, PA2VA(pa), PGSIZE);
-        uint64_t mem_pa = VA2PA(mem);
-        if (mappages(new, i, PGSIZE, mem_pa, PTE_R | PTE_W | PTE_U) != 0) {
-            kfree(mem);
-            freevm(new, i);
-            return NULL;
+        for (int k = 0; k < n; k++) {
+            // copy content
+            if (pas[k] & PTE_SWAP) {
+                if (swap_in_page(pas[k], mem[k]) != 0) {
+                    kfree_batch(&mem[k], n - k);
+                    ptc_finish(&dst);
+                    freevm(new, sz);
+                    return NULL;
+                }
+            } else {
+                memcpy(mem[k], PA2VA(pas[k]), PGSIZE);
+            }
+            if (ptc_map(&dst, vas[k], VA2PA(mem[k]), PTE_R | PTE_W | PTE_U) != 0) {
+                kfree_batch(&mem[k], n - k);
+                ptc_finish(&dst);
+                freevm(new, sz);
+                return NULL;
+            }
         }
     }
+    ptc_finish(&src);
+    ptc_finish(&dst);
     return new;
 }
 
+// ---- page reclaim and swap ----
+//
+// A clock hand sweeps the user leaves of every registered address space
+// (vm_spaces). frames mapped more than once, the zero page and pinned
+// frames are skipped. PTE_A gives a page a second chance: the sweep clears
+// it, and a page found with it still clear is evicted. the first sweep of
+// a call only takes pages that are also clean (PTE_D clear); later sweeps
+// take dirty ones and split unreferenced huge leaves into 4KB pages. a
+// victim goes to swap_out() (a zero flag, the compressed pool or a disk
+// slot) and its PTE becomes a swap entry (see swap.h); vm_fault() brings
+// it back on the next access.
+// reclaim runs from the idle loop and from user allocations once free
+// memory is below the low watermark, until it is back above the high
+// one, and directly when an allocation for user memory fails.
+
+#define VM_UVA_END (1UL << 38)      // top of the Sv39 lower half
+
+static int clock_space = 0;         // clock hand: address space ...
+static uint64_t clock_va = USERBASE; // ... and VA in it
+static int reclaim_active = 0;      // crossed low, not yet back at high (reclaim_lock)
+static uint64_t reclaim_scanned = 0;
+static uint64_t reclaim_evicted = 0;
+
+static size_t wmark_low(void) { return kmem_total_pages() / 64; }
+static size_t wmark_high(void) { return kmem_total_pages() / 32; }
+
+// hand the page behind *pte (at va of c->root) to swap_out() and leave
+// the swap entry it returns. returns -1 if no tier took the page.
+static int evict_page(struct pt_cursor *c, pte_t *pte, uint64_t va) {
+    pte_t old = *pte;
+    uint64_t pa = pte_to_pa(old);
+    // unmap first: no store may land after the copy is taken. swap_out()
+    // may be a polled disk write, so for all that time the PTE holds a
+    // SWAP_BUSY marker: vm_fault() retries the access until it is gone,
+    // and unmap/fork wait for it (pte_settle()). the exchange fails if
+    // the hardware set A or D since old was read
+    pte_t busy = SWAP_PTE(SWAP_BUSY, 0, old);
+    if (!__atomic_compare_exchange_n(pte, &old, busy, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return -1;
+    vm_flush_range(c->root, va, PGSIZE, 0);
+    pte_t ent = swap_out(PA2VA(pa), old);
+    if (!ent) {
+        __atomic_store_n(pte, old, __ATOMIC_RELEASE);
+        return -1;
+    }
+    __atomic_store_n(pte, ent, __ATOMIC_RELEASE);
+    kfree(PA2VA(pa));
+    return 0;
+}
+
+// one turn of the clock over all address spaces, from the hand on.
+// returns pages evicted (at most want). reclaim_lock held.
+static size_t clock_sweep(size_t want, int pass) {
+    size_t got = 0;
+    for (int n = 0; n <= NVMSPACE && got < want; n++) {
+        acquire(&space_lock);
+        pagetable_t pt = vm_spaces[clock_space];
+        release(&space_lock);
+        if (pt) {
+            struct pt_cursor c;
+            ptc_init(&c, pt, 0);
+            int level;
+            pte_t *pte;
+            while (got < want && (pte = ptc_next(&c, &clock_va, VM_UVA_END, &level)) != NULL) {
+                uint64_t va = clock_va;
+                uint64_t lsz = level_size(level);
+                clock_va = (va & ~(lsz - 1)) + lsz;
+                if (!(*pte & PTE_V)) continue;
+                uint64_t pa = pte_to_pa(*pte);
+                if (is_zero_page(pa) || kmem_page_state(PA2VA(pa)) != PG_ALLOC ||
+                    kmem_page_refcnt(PA2VA(pa)) != 1)
+                    continue;
+                reclaim_scanned++;
+                if (*pte & PTE_A) {
+                    if (pass > 0) {
+                        *pte &= ~PTE_A;
+                        ptc_dirty(&c, va & ~(lsz - 1), lsz);
+                    }
+                    continue;
+                }
+                if (level > 0) {
+                    // cold huge page: split, then look at its 4KB pages
+                    if (pass > 0 && level == 1 && split_leaf(pte, level) == 0)
+                        clock_va = va & ~(lsz - 1);
+                    continue;
+                }
+                if (pass == 0 && (*pte & PTE_D)) continue;
+                if (evict_page(&c, pte, va) != 0) {
+                    if (!swap_full()) continue;   // just this page didn't fit
+                    want = got;     // swap full: stop here
+                    break;
+                }
+                got++;
+            }
+            ptc_finish(&c);
+            if (got >= want) break; // the hand stays in this address space
+        }
+        clock_space = (clock_space + 1) % NVMSPACE;
+        clock_va = USERBASE;
+    }
+    return got;
+}
+
+// swap out up to want user pages. reclaim_lock held.
+static size_t reclaim_locked(size_t want) {
+    size_t got = 0;
+    for (int pass = 0; pass < 3 && got < want; pass++)
+        got += clock_sweep(want - got, pass);
+    reclaim_evicted += got;
+    return got;
+}
+
+// vm_reclaim: free up to want pages, empty slab pages first, then by
+// swapping out user pages. returns how many were freed.
+size_t vm_reclaim(size_t want) {
+    if (want == 0) return 0;
+    size_t got = kmem_slab_reclaim();
+    if (!swap_enabled() || got >= want) return got;
+    acquire(&reclaim_lock);
+    got += reclaim_locked(want - got);
+    release(&reclaim_lock);
+    return got;
+}
+
+// vm_reclaim_check: one VM_RECLAIM_BATCH of reclaim if free memory is
+// between the watermarks (after dropping below low). returns pages freed.
+// reclaim_active and the batch change together under reclaim_lock.
+size_t vm_reclaim_check(void) {
+    if (!swap_enabled()) return 0;
+    // unlocked peek for the common case: plenty of memory, not reclaiming
+    if (!__atomic_load_n(&reclaim_active, __ATOMIC_RELAXED) &&
+        kmem_free_pages() >= wmark_low())
+        return 0;
+    acquire(&reclaim_lock);
+    size_t nfree = kmem_free_pages();
+    size_t got = 0;
+    if (!reclaim_active && nfree < wmark_low())
+        reclaim_active = 1;
+    if (reclaim_active) {
+        size_t high = wmark_high();
+        if (nfree >= high) {
+            reclaim_active = 0;
+        } else {
+            size_t want = high - nfree;
+            got = reclaim_locked(want < VM_RECLAIM_BATCH ? want : VM_RECLAIM_BATCH);
+            if (got == 0)
+                reclaim_active = 0; // nothing left to take (or no swap room)
+        }
+    }
+    release(&reclaim_lock);
+    return got;
+}
+
+// idle-loop hook
+size_t vm_reclaim_idle(void) {
+    return vm_reclaim_check();
+}
+
+// swap_in: bring the page behind swap entry *pte (at va) back. a page
+// still being evicted (SWAP_BUSY) is left alone: returns 0 and the caller
+// retries the access once the eviction has finished.
+static int swap_in(pagetable_t pagetable, uint64_t va, pte_t *pte, int write) {
+    pte_t ent = *pte;
+    if (PTE_SWAP_TYPE(ent) == SWAP_BUSY) return 0;
+    if (PTE_SWAP_TYPE(ent) == SWAP_ZERO && !write) {
+        // a read of a page evicted as all zeroes: share the zero page
+        // until the first store, as a lazy page would
+        pte_t flags = ent & (PTE_R | PTE_X | PTE_U);
+        if (ent & (PTE_W | PTE_COW)) flags |= PTE_COW;
+        *pte = pa_to_pte(VA2PA(zero_page), flags | PTE_A | PTE_V);
+        vm_flush_range(pagetable, va, PGSIZE, 0);
+        return 0;
+    }
+    // reclaim only evicts valid pages and never frees page-table pages,
+    // so *pte is unchanged after this
+    void *mem = alloc_user_page(0);
+    if (!mem) return -1;
+    if (swap_in_page(ent, mem) != 0) {
+        kfree(mem);
+        return -1;
+    }
+    *pte = pa_to_pte(VA2PA(mem), (ent & PTE_SWAP_KEEP) | PTE_A | PTE_V);
+    swap_free(ent);
+    vm_flush_range(pagetable, va, PGSIZE, 0);
+    return 0;
+}
+
+void vm_reclaim_stats(uint64_t *scanned, uint64_t *evicted) {
+    acquire(&reclaim_lock);
+    if (scanned) *scanned = reclaim_scanned;
+    if (evicted) *evicted = reclaim_evicted;
+    release(&reclaim_lock);
+}
+
+// ---- copy-on-write ----
+
+static uint64_t cow_faults = 0;     // store faults resolved on COW pages
+static uint64_t cow_copies = 0;     // ... of which needed a private copy
+
+// copyuvm_cow: like copyuvm(), but the child shares every physical page
+// with the parent. writable leaves lose PTE_W and gain PTE_COW in both page
+// tables; each shared page gets one extra reference, and the first store
+// through either mapping is resolved by vm_cow_fault(). superpage leaves
+// are split first so that pages are shared and copied 4KB at a time.
+pagetable_t copyuvm_cow(pagetable_t old, uint64_t sz) {
+    pagetable_t new = proc_pagetable_create();
+    if (!new) return NULL;
+    if (lazy_copy(old, new, sz) != 0) {
+        freevm(new, 0);
+        return NULL;
+    }
+    struct pt_cursor src, dst;
+    ptc_init(&src, old, 0);
+    ptc_init(&dst, new, 0);
+    uint64_t i = 0;
+    int level;
+    pte_t *pte;
+    while ((pte = ptc_next(&src, &i, sz, &level)) != NULL) {
+        pte_settle(pte);
+        if (level > 0) {
+            if (split_leaf(pte, level) != 0) goto fail;
+            continue;   // look again, now one level down
+        }
+        if (PTE_IS_SWAP(*pte)) {
+            // both sides refer to the stored copy; each swaps in its own
+            int got;
+            pte_t *d = ptc_walk(&dst, i, 0, 1, &got);
+            if (!d || got != 0) goto fail;
+            *d = *pte;
+            swap_dup(*pte);
+            i += PGSIZE;
+            continue;
+        }
+        if (*pte & PTE_W) {
+            *pte = (*pte & ~PTE_W) | PTE_COW;
+            ptc_dirty(&src, i, PGSIZE);
+        }
+        uint64_t pa = pte_to_pa(*pte);
+        int flags = *pte & 0x3FF & ~PTE_V;
+        if (ptc_map(&dst, i, pa, flags) != 0) goto fail;
+        if (!is_zero_page(pa))
+            kmem_page_get(PA2VA(pa));
+        i += PGSIZE;
+    }
+    // the parent's cached writable translations must go
+    ptc_finish(&src);
+    ptc_finish(&dst);
+    return new;
+
+fail:
+    ptc_finish(&src);
+    ptc_finish(&dst);
+    freevm(new, sz);
+    return NULL;
+}
+
+// vm_cow_fault: resolve a store fault at va on a COW page of pagetable.
+// the last sharer just gets write access back; everyone else gets a
+// private copy. returns 0 if handled, -1 if va is not a COW page.
+int vm_cow_fault(pagetable_t pagetable, uint64_t va) {
+    int level;
+    pte_t *pte = walk_level(pagetable, va, 0, 0, &level);
+    if (!pte || level != 0) return -1;
+    if ((*pte & (PTE_V | PTE_COW)) != (PTE_V | PTE_COW)) return -1;
+
+    uint64_t pa = pte_to_pa(*pte);
+    int flags = (*pte & 0x3FF & ~PTE_COW) | PTE_W;
+    __atomic_add_fetch(&cow_faults, 1, __ATOMIC_RELAXED);
+    if (is_zero_page(pa)) {
+        // first store to an untouched lazy page: a fresh zeroed page
+        void *mem = alloc_user_page(1);
+        if (!mem) return -1;
+        *pte = pa_to_pte(VA2PA(mem), flags);
+    } else if (kmem_page_refcnt(PA2VA(pa)) == 1) {
+        // every other sharer is gone: the page is ours
+        *pte = pa_to_pte(pa, flags);
+    } else {
+        // the whole page is overwritten by the copy below. reclaim skips
+        // frames mapped more than once, so pa cannot be evicted meanwhile
+        void *mem = alloc_user_page(0);
+        if (!mem) return -1;
+        memcpy(mem, PA2VA(pa), PGSIZE);
+        *pte = pa_to_pte(VA2PA(mem), flags);
+        vm_flush_range(pagetable, va, PGSIZE, 0);
+        kfree(PA2VA(pa));   // drop our reference to the shared page
+        __atomic_add_fetch(&cow_copies, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    vm_flush_range(pagetable, va, PGSIZE, 0);
+    return 0;
+}
+
+// vm_fault: page-fault entry from the trap path. scause is 12/13/15
+// (instruction/load/store page fault), va the faulting address (stval).
+// returns 0 if the fault was resolved and the instruction can be retried.
+int vm_fault(pagetable_t pagetable, uint64_t va, uint64_t scause) {
+    if (!pagetable) return -1;
+    va &= ~(PGSIZE - 1);
+    pte_t *pte = walk(pagetable, va, 0);
+    if (pte && PTE_IS_SWAP(*pte))
+        return swap_in(pagetable, va, pte, scause == 15);
+    if (scause == 15 && vm_cow_fault(pagetable, va) == 0)
+        return 0;
+    if (scause == 13 || scause == 15)
+        return vm_lazy_fault(pagetable, va, scause == 15);
+    return -1;
+}
+
+// page table currently installed in satp on this hart (NULL if paging is off)
+pagetable_t vm_current_pagetable(void) {
+    uint64_t satp = r_satp();
+    if ((satp >> 60) != SATP_MODE_SV39) return NULL;
+    return (pagetable_t)PA2VA((satp & ((1UL << 44) - 1)) << PGSHIFT);
+}
+
+void vm_cow_stats(uint64_t *faults, uint64_t *copies) {
+    if (faults) *faults = __atomic_load_n(&cow_faults, __ATOMIC_RELAXED);
+    if (copies) *copies = __atomic_load_n(&cow_copies, __ATOMIC_RELAXED);
+}
+
+// ---- zero-copy remapping ----
+
+#define VM_REMAP_TRIES 4    // rounds of swap-in before giving up on reclaim
+
+// vm_remap: hand the physical pages behind [srcva, srcva+size) of src to
+// dst at dstva by editing PTEs, without copying data.
+//   VM_REMAP_MOVE:     the PTEs move; src loses the range (and its TLB
+//                      entries), dst gets the same permissions.
+//   VM_REMAP_SHARE_RO: src keeps its mappings; dst maps the same frames
+//                      read-only, each frame gaining a reference.
+// every source page must be mapped or swapped out (swapped pages are read
+// back, huge leaves are split) and the target range must be empty. a
+// SHARE_RO target has neither PTE_W nor PTE_COW, so stores to it fault and
+// vm_fault() refuses them. returns 0, or -1 with no mapping changed
+// (swapped source pages may have been read back, huge source leaves split,
+// target tables added).
+// physically contiguous runs go to dst with one mappages() call each.
+int vm_remap(pagetable_t src, uint64_t srcva, pagetable_t dst, uint64_t dstva,
+             uint64_t size, int mode) {
+    if (((srcva | dstva | size) & (PGSIZE - 1)) != 0 || size == 0) return -1;
+    if (mode != VM_REMAP_MOVE && mode != VM_REMAP_SHARE_RO) return -1;
+    if (src == dst && srcva < dstva + size && dstva < srcva + size) return -1;
+
+    // check both sides first; the target's page-table pages are allocated
+    // here, so the mappages() calls below cannot fail. swapped-out source
+    // pages are brought back and huge leaves split down to 4KB. those
+    // allocations may make reclaim evict a page already checked, so look
+    // over the source again afterwards (nothing allocates in that pass)
+    for (int tries = 0;; tries++) {
+        if (tries == VM_REMAP_TRIES) return -1;
+        for (uint64_t off = 0; off < size; off += PGSIZE) {
+            int level;
+            pte_t *pte;
+            for (;;) {
+                pte = walk_level(src, srcva + off, 0, 0, &level);
+                if (!pte) return -1;
+                if (PTE_IS_SWAP(*pte)) {
+                    if (swap_in(src, srcva + off, pte, 0) != 0) return -1;
+                    continue;
+                }
+                if (!(*pte & PTE_V)) return -1;
+                if (level == 0) break;
+                // a 1GB leaf takes two rounds: to 2MB, then to 4KB
+                if (split_leaf(pte, level) != 0) return -1;
+            }
+            pte_t *dpte = walk(dst, dstva + off, 1);
+            if (!dpte || *dpte != 0) return -1;
+        }
+        uint64_t off = 0;
+        for (; off < size; off += PGSIZE) {
+            pte_t *pte = walk(src, srcva + off, 0);
+            if (!(*pte & PTE_V)) break;
+        }
+        if (off == size) break;
+    }
+
+    uint64_t run_off = 0, run_pa = 0, run_len = 0;
+    int run_flags = 0;
+    for (uint64_t off = 0; off <= size; off += PGSIZE) {
+        uint64_t pa = 0;
+        int flags = 0;
+        if (off < size) {
+            pte_t *pte = walk(src, srcva + off, 0);
+            pa = pte_to_pa(*pte);
+            flags = *pte & 0x3FF & ~PTE_V;
+            if (mode == VM_REMAP_SHARE_RO) {
+                flags &= ~(PTE_W | PTE_COW);
+                if (!is_zero_page(pa))
+                    kmem_page_get(PA2VA(pa));
+            } else {
+                *pte = 0;
+            }
+            if (run_len && pa == run_pa + run_len && flags == run_flags) {
+                run_len += PGSIZE;
+                continue;
+            }
+        }
+        if (run_len && mappages(dst, dstva + run_off, run_len, run_pa, run_flags) != 0)
+            panic("vm_remap: mappages");
+        run_off = off;
+        run_pa = pa;
+        run_len = PGSIZE;
+        run_flags = flags;
+    }
+    // the frames may only be used through dst once src cannot reach them
+    if (mode == VM_REMAP_MOVE)
+        vm_flush_range(src, srcva, size, 0);
+    return 0;
+}
+
 pagetable_t kernel_pagetable = NULL;
 
-/* helper: wrapper to call mappages for kernel mapping convenience */
+/* helper: wrapper to call mappages for kernel mapping convenience;
+ * uses 2MB/1GB leaves wherever alignment allows. kernel mappings are
+ * global (PTE_G): present in every address space */
 static int kvmmap(pagetable_t pt, uint64_t va, uint64_t pa, uint64_t size, int perm) {
-    return mappages(pt, va, size, pa, perm);
+    return mappages_level(pt, va, size, pa, perm | PTE_G, 2);
 }
 
 /* print PTE flags as string */
@@ -203,11 +1447,6 @@ static void print_pte_flags(pte_t pte) {
     printf("%s", f);
 }
 
-/* level_size: level 0 -> 4KB, level 1 -> 2MB, level 2 -> 1GB */
-static inline uint64_t level_size(int level) {
-    return 1UL << (PGSHIFT + 9 * level);
-}
-
 /* print indent */
 static void print_indent(int depth) {
     for (int i = 0; i < depth; i++) consputc(' ');
@@ -271,27 +1510,32 @@ void print_pagetable(pagetable_t root) {
 /* kvminit: build kernel pagetable (but do not write satp) */
 void kvminit(void) {
     if (kernel_pagetable) return;
-    kernel_pagetable = proc_pagetable_create();
+    kernel_pagetable = kvm_pagetable_create();
     if (!kernel_pagetable) panic("kvminit: cannot alloc kernel_pagetable");
 
+    // the zero page behind lazy allocations
+    zero_page = kalloc();
+    if (!zero_page) panic("kvminit: cannot alloc zero page");
+    kmem_page_set_state(zero_page, PG_PINNED);
+
     /* map devices: UART0 */
 #ifdef UART0
     kvmmap(kernel_pagetable, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 #endif
 // 映射 VIRTIO 磁盘寄存器
 #ifdef VIRTIO0
-    kvmmap(kernel_pagetable, VIRTIO0, PGSIZE, VIRTIO0, PTE_R | PTE_W);
+    kvmmap(kernel_pagetable, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 #endif
 
     // 映射 PLIC 寄存器
 #ifdef PLIC
-    kvmmap(kernel_pagetable, PLIC, 0x400000, PLIC, PTE_R | PTE_W);
+    kvmmap(kernel_pagetable, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 #endif
 
     // 映射 CLINT 寄存器
 #ifdef CLINT
     // CLINT 区域很小，映射一个页面就足够了
-    kvmmap(kernel_pagetable, CLINT, 0x10000, CLINT, PTE_R | PTE_W);
+    kvmmap(kernel_pagetable, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
 #endif
     /* identity-map kernel physical memory [KERNBASE, PHYSTOP) */
 #ifdef KERNBASE
@@ -303,9 +1547,16 @@ void kvminit(void) {
 #else
 #warning "KERNBASE not defined; kernel memory mapping skipped"
 #endif
+
+    /* mark the top-level kernel entries global: proc_pagetable_create()
+     * shares exactly these. the kernel map must be complete by now, later
+     * kvmmap()s into new slots would not reach existing address spaces. */
+    for (int i = 0; i < 512; i++)
+        if (kernel_pagetable[i] & PTE_V)
+            kernel_pagetable[i] |= PTE_G;
 }
 
-/* kvminithart: write kernel_pagetable -> satp and sfence.vma */
+/* kvminithart: write kernel_pagetable -> satp (ASID 0) and sfence.vma */
 void kvminithart(void) {
     if (!kernel_pagetable) panic("kvminithart: kernel_pagetable not initialized");
     uint64_t root_pa = VA2PA((uint64_t)kernel_pagetable);
@@ -313,4 +1564,11 @@ void kvminithart(void) {
     uint64_t satp_val = (SATP_MODE_SV39 << 60) | root_ppn;
     asm volatile("csrw satp, %0" :: "r"(satp_val) : "memory");
     asm volatile("sfence.vma" ::: "memory");
+    acquire(&asid_lock);
+    if (asid_bits < 0) {
+        asid_probe(satp_val);
+        asid_map[0] = 1;        // ASID 0: kernel
+    }
+    asid_harts[cpuid()].active = kernel_pagetable;
+    release(&asid_lock);
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #define VM_H
 
 #include "riscv.h"
+#include <stddef.h>
 #include <stdint.h>
 
 // pagetable_t is a pointer to a page-sized array of pte_t
@@ -10,19 +11,79 @@ typedef pte_t *pagetable_t;
 
 extern pagetable_t kernel_pagetable;
 
-pagetable_t proc_pagetable_create(void); // alloc and zero a root pagetable page
+// pages handed to kalloc_batch()/kfree_batch() per call by the range
+// operations in vm.c
+#define VM_BATCH 64
+
+#define PTC_FREEQ 16        // pages a pt_cursor queues before flushing
+
+// TLB flushes of at most this many pages are done page by page
+// (sfence.vma va, asid); larger ones flush the whole ASID
+#define VM_FLUSH_PAGES 32
+
+// pt_cursor: walks one page table front to back, keeping the level-1 and
+// level-0 tables of the last lookup so consecutive VAs don't restart at
+// the root. see ptc_* in vm.c.
+struct pt_cursor {
+    pagetable_t root;
+    pagetable_t tbl[2];     // cached level-0 / level-1 tables (NULL = none)
+    uint64_t tag[2];        // VA span (va >> shift) each cached table covers
+    pte_t *ppte[2];         // parent PTE pointing at tbl[l]
+    int prune;              // free tables left empty when the cursor moves on
+    uint64_t flo, fhi;      // VA range whose PTEs changed since the last flush
+    int ftables;            // ... and a page-table page was unlinked
+    int nfree;
+    void *freeq[PTC_FREEQ]; // pages to free after the next TLB flush
+};
+
+pagetable_t proc_pagetable_create(void); // new root sharing the kernel's top-level entries
+pagetable_t kvm_pagetable_create(void);  // alloc and zero a bare root pagetable page
 void proc_pagetable_free(pagetable_t pagetable); // free all pages (and page table pages)
 
-pte_t *walk(pagetable_t pagetable, uint64_t va, int alloc);
+pte_t *walk(pagetable_t pagetable, uint64_t va, int alloc); // leaf PTE (4KB slot or covering superpage)
+pte_t *walk_level(pagetable_t pagetable, uint64_t va, int level, int alloc, int *leaf_level);
 int mappages(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, int perm);
+int mappages_level(pagetable_t pagetable, uint64_t va, uint64_t size, uint64_t pa, int perm, int maxlevel);
 void unmap_pages(pagetable_t pagetable, uint64_t va, uint64_t size); // unmap and free physical pages
 uint64_t walkaddr(pagetable_t pagetable, uint64_t va); // get PA mapped by va (or 0)
 
+// vm_remap() modes
+#define VM_REMAP_MOVE     1 // unmap from the source
+#define VM_REMAP_SHARE_RO 2 // keep the source, map read-only in the target
+int vm_remap(pagetable_t src, uint64_t srcva, pagetable_t dst, uint64_t dstva,
+             uint64_t size, int mode); // move/share pages by PTE edits, 0 or -1
+
+void ptc_init(struct pt_cursor *c, pagetable_t root, int prune);
+pte_t *ptc_walk(struct pt_cursor *c, uint64_t va, int level, int alloc, int *leaf_level);
+pte_t *ptc_next(struct pt_cursor *c, uint64_t *va, uint64_t end, int *level); // next valid leaf in [*va, end)
+int ptc_map(struct pt_cursor *c, uint64_t va, uint64_t pa, int perm);      // 4KB leaf
+void ptc_finish(struct pt_cursor *c); // prune, flush TLB, free queued pages
+
 int uvmalloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz);
+int uvmalloc_lazy(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz); // record only; map on fault
 void uvmdealloc(pagetable_t pagetable, uint64_t oldsz, uint64_t newsz);
+int vm_lazy_fault(pagetable_t pagetable, uint64_t va, int write);
+uint64_t vm_resident_pages(pagetable_t pagetable, uint64_t sz); // private pages mapped below sz
+void vm_lazy_stats(uint64_t *faults, uint64_t *zero_hits);
+void vm_huge_stats(uint64_t *live, uint64_t *fallbacks); // huge leaves mapped now, 4KB fallbacks
+
+#define VM_RECLAIM_BATCH 32 // pages per watermark-driven reclaim step
+size_t vm_reclaim(size_t want);       // free empty slabs, then swap out user pages; returns count
+size_t vm_reclaim_check(void);        // reclaim a batch if below the watermarks
+size_t vm_reclaim_idle(void);         // idle-loop hook, returns pages freed
+void vm_reclaim_stats(uint64_t *scanned, uint64_t *evicted);
 pagetable_t copyuvm(pagetable_t old, uint64_t sz);
+pagetable_t copyuvm_cow(pagetable_t old, uint64_t sz); // share pages copy-on-write
+int vm_cow_fault(pagetable_t pagetable, uint64_t va);   // resolve a store to a COW page
+int vm_fault(pagetable_t pagetable, uint64_t va, uint64_t scause); // 0 = handled, retry
+pagetable_t vm_current_pagetable(void);                 // root installed in satp, or NULL
+void vm_cow_stats(uint64_t *faults, uint64_t *copies);
 void freevm(pagetable_t pagetable, uint64_t sz);
 void print_pagetable(pagetable_t root);
 void kvminit(void);
 void kvminithart(void);
+void vm_switch(pagetable_t pagetable);  // install in satp under its ASID
+void vm_flush_range(pagetable_t pagetable, uint64_t va, uint64_t size, int tables);
+uint64_t vm_asid_rollovers(void);
+uint64_t vm_pagetable_pages(void); // page-table pages currently allocated
 #endif // VM_H
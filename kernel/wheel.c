@@ -0,0 +1,301 @@
+// kernel/wheel.c
+// 每个核一个分层时间轮，见 wheel.h。
+//
+// 第 L 层的每个槽覆盖 64^L 个刻度。到期刻度为 e 的定时器放在满足下面条件的
+// 最低一层 L：把 e 和“当前刻度 clk 向上取整到 64^L”都右移 6L 位，差小于 64。
+// 槽号就是 e 右移 6L 位后的低 6 位。这样每层最多只看得到 64 个块，
+// 槽号和块一一对应，挂上去不用比较、不用遍历，O(1)。
+//
+// 第 L 层（L > 0）的一个槽在时间走到它那一块的起点时才处理：把里面的定时器
+// 按真正的到期刻度重新挂到更低的层（“懒”级联，没到时间的槽不动）。
+// 第 0 层的槽到了就执行回调。每层有一个 64 位的占用位图，下一次要处理的时刻
+// 用循环移位 + ctz 直接算出来，所以没有逐刻度的扫描：轮子借 timer.c 的
+// 一个定时器，只在下一次有事要做的时刻触发时钟中断。时钟中断里只把轮子的
+// 处理排进 softirq，级联和回调都在下半部开着中断做。
+//
+// clk 是“还没处理的第一个刻度”。轮子空闲时 clk 会落后于真实时间，
+// 挂新定时器前先把它追上来（只要中间没有要处理的事就可以直接跳过去）。
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include "softirq.h"
+#include "wheel.h"
+
+#define WHEEL_NEVER (~0UL)
+
+struct wheel {
+  struct spinlock lock;
+  uint64 clk;
+  uint64 occupied[WHEEL_LEVELS];      // 第 i 位 = 第 i 个槽非空
+  struct wtimer *slot[WHEEL_LEVELS][WHEEL_SIZE];
+  struct timer hw;                    // 驱动轮子的那个 timer.c 定时器
+  uint64 hw_next;                     // hw 设在哪个刻度，WHEEL_NEVER = 没设
+  struct work work;                   // hw 到期后排进 softirq 的处理
+  struct wheel_stats st;
+} __attribute__((aligned(64)));
+
+static struct wheel wheels[NCPU];
+
+static void wheel_fire(void *arg);
+static void wheel_run(void *arg);
+
+static inline uint64
+now_tick(void)
+{
+  return r_time() / WHEEL_TICK;
+}
+
+// 第 l 层当前能看到的第一块：clk 向上取整到 64^l
+static inline uint64
+level_start(struct wheel *w, int l)
+{
+  int shift = l * WHEEL_BITS;
+  return (w->clk + (1UL << shift) - 1) >> shift;
+}
+
+// 把 t 挂到合适的层和槽上，返回这个槽要处理的刻度
+static uint64
+slot_insert(struct wheel *w, struct wtimer *t)
+{
+  uint64 e = t->expires < w->clk ? w->clk : t->expires;
+  int l;
+  uint64 k = 0;
+  for(l = 0; l < WHEEL_LEVELS; l++){
+    k = e >> (l * WHEEL_BITS);
+    if(k - level_start(w, l) < WHEEL_SIZE)
+      break;
+  }
+  if(l == WHEEL_LEVELS){
+    // 太远：先放在最高层能看到的最后一块，到时候再按 expires 重新挂
+    l = WHEEL_LEVELS - 1;
+    k = level_start(w, l) + WHEEL_SIZE - 1;
+  }
+  int s = k & (WHEEL_SIZE - 1);
+  t->level = l;
+  t->slot = s;
+  t->prev = 0;
+  t->next = w->slot[l][s];
+  if(t->next)
+    t->next->prev = t;
+  w->slot[l][s] = t;
+  w->occupied[l] |= 1UL << s;
+  return k << (l * WHEEL_BITS);
+}
+
+static void
+slot_remove(struct wheel *w, struct wtimer *t)
+{
+  if(t->prev)
+    t->prev->next = t->next;
+  else
+    w->slot[t->level][t->slot] = t->next;
+  if(t->next)
+    t->next->prev = t->prev;
+  if(w->slot[t->level][t->slot] == 0)
+    w->occupied[t->level] &= ~(1UL << t->slot);
+  t->next = t->prev = 0;
+}
+
+// 下一次要处理的刻度：所有层里最早的非空槽的起点
+static uint64
+next_event(struct wheel *w)
+{
+  uint64 best = WHEEL_NEVER;
+  for(int l = 0; l < WHEEL_LEVELS; l++){
+    uint64 occ = w->occupied[l];
+    if(occ == 0)
+      continue;
+    uint64 start = level_start(w, l);
+    int d = start & (WHEEL_SIZE - 1);
+    uint64 rot = d ? (occ >> d) | (occ << (WHEEL_SIZE - d)) : occ;
+    uint64 t = (start + __builtin_ctzl(rot)) << (l * WHEEL_BITS);
+    if(t < best)
+      best = t;
+  }
+  return best;
+}
+
+// 让 hw 在下一次要处理的刻度触发。持有 w->lock
+static void
+wheel_program(struct wheel *w)
+{
+  uint64 next = next_event(w);
+  if(next == w->hw_next)
+    return;
+  w->hw_next = next;
+  if(next == WHEEL_NEVER)
+    timer_cancel(&w->hw);
+  else
+    timer_add(&w->hw, next * WHEEL_TICK, wheel_fire, w);
+}
+
+void
+wheelinithart(void)
+{
+  struct wheel *w = &wheels[cpuid()];
+  initlock(&w->lock, "wheel");
+  w->clk = now_tick();
+  w->hw_next = WHEEL_NEVER;
+  w->work = (struct work)WORK_INIT(wheel_run, w);
+}
+
+// 在 deadline（r_time() 的值）之后调用 fn(arg)，挂在本核的轮子上。
+// t 已经挂着时先摘下来
+void
+wtimer_add(struct wtimer *t, uint64 deadline, void (*fn)(void *), void *arg)
+{
+  wtimer_cancel(t);
+  int intr = intr_save();
+  struct wheel *w = &wheels[cpuid()];
+  acquire(&w->lock);
+  // 空闲时 clk 落后于现在：中间没有要处理的事就直接追上来，
+  // 新定时器才能放进尽量低的层
+  uint64 now = now_tick();
+  if(now > w->clk && next_event(w) > now)
+    w->clk = now;
+  t->expires = (deadline + WHEEL_TICK - 1) / WHEEL_TICK;
+  t->fn = fn;
+  t->arg = arg;
+  t->hart = cpuid() + 1;
+  uint64 at = slot_insert(w, t);
+  w->st.armed++;
+  w->st.pending++;
+  // 只有比已经设好的时刻更早才需要动 hw
+  if(at < w->hw_next){
+    w->hw_next = at;
+    timer_add(&w->hw, at * WHEEL_TICK, wheel_fire, w);
+  }
+  release(&w->lock);
+  intr_restore(intr);
+}
+
+// 摘下 t。返回 1 表示它到期前被取消了；0 表示没挂着。
+// 不改 hw：那边最多白来一次中断
+int
+wtimer_cancel(struct wtimer *t)
+{
+  int intr = intr_save();
+  for(;;){
+    int hart = __atomic_load_n(&t->hart, __ATOMIC_ACQUIRE);
+    if(hart == 0){
+      intr_restore(intr);
+      return 0;
+    }
+    struct wheel *w = &wheels[hart - 1];
+    acquire(&w->lock);
+    if(t->hart != hart){
+      release(&w->lock);
+      continue;
+    }
+    slot_remove(w, t);
+    t->hart = 0;
+    w->st.cancelled++;
+    w->st.pending--;
+    release(&w->lock);
+    intr_restore(intr);
+    return 1;
+  }
+}
+
+// 处理刻度 at：先把各层在这一刻开始的块级联下来，再执行第 0 层到期的回调。
+// 持有 w->lock 并关着中断，回调时暂时放开、恢复成 intr
+static void
+wheel_process(struct wheel *w, uint64 at, int intr)
+{
+  w->clk = at;
+  for(int l = WHEEL_LEVELS - 1; l > 0; l--){
+    int shift = l * WHEEL_BITS;
+    if(at & ((1UL << shift) - 1))
+      continue;
+    int s = (at >> shift) & (WHEEL_SIZE - 1);
+    struct wtimer *t = w->slot[l][s];
+    w->slot[l][s] = 0;
+    w->occupied[l] &= ~(1UL << s);
+    while(t){
+      struct wtimer *next = t->next;
+      slot_insert(w, t);
+      w->st.cascaded++;
+      t = next;
+    }
+  }
+  int s = at & (WHEEL_SIZE - 1);
+  struct wtimer *t;
+  while((t = w->slot[0][s]) != 0){
+    slot_remove(w, t);
+    t->hart = 0;
+    w->st.expired++;
+    w->st.pending--;
+    release(&w->lock);
+    intr_restore(intr);
+    t->fn(t->arg);
+    intr_save();
+    acquire(&w->lock);
+  }
+  // 回调里的 wtimer_add() 可能已经把 clk 追到了更后面，不能往回拨
+  if(w->clk <= at)
+    w->clk = at + 1;
+}
+
+// hw 到期（在 timer_intr() 里，关中断）：只排队，处理放到下半部
+static void
+wheel_fire(void *arg)
+{
+  struct wheel *w = arg;
+  work_queue(&w->work);
+}
+
+// 下半部：处理所有已经到了的刻度，再把 hw 设到下一次
+static void
+wheel_run(void *arg)
+{
+  struct wheel *w = arg;
+  uint64 t0 = r_cycle();
+  int intr = intr_save();
+  acquire(&w->lock);
+  w->hw_next = WHEEL_NEVER;
+  uint64 now = now_tick();
+  uint64 at;
+  while((at = next_event(w)) <= now)
+    wheel_process(w, at, intr);
+  if(now >= w->clk)
+    w->clk = now + 1;
+  w->st.runs++;
+  w->st.run_cycles += r_cycle() - t0;
+  wheel_program(w);
+  release(&w->lock);
+  intr_restore(intr);
+}
+
+void
+wheel_get_stats(struct wheel_stats *st)
+{
+  *st = (struct wheel_stats){ 0 };
+  for(int i = 0; i < NCPU; i++){
+    struct wheel *w = &wheels[i];
+    if(w->lock.name == 0)
+      continue;
+    int intr = intr_save();
+    acquire(&w->lock);
+    st->armed += w->st.armed;
+    st->cancelled += w->st.cancelled;
+    st->expired += w->st.expired;
+    st->cascaded += w->st.cascaded;
+    st->runs += w->st.runs;
+    st->run_cycles += w->st.run_cycles;
+    st->pending += w->st.pending;
+    release(&w->lock);
+    intr_restore(intr);
+  }
+}
+
+void
+wheel_print_stats(void)
+{
+  struct wheel_stats st;
+  wheel_get_stats(&st);
+  printf("wheel: %llu armed, %llu cancelled, %llu expired, %llu cascaded, %llu pending\n",
+         st.armed, st.cancelled, st.expired, st.cascaded, st.pending);
+  printf("wheel: %llu runs, %llu cycles\n", st.runs, st.run_cycles);
+}
@@ -0,0 +1,43 @@
+// kernel/wheel.h
+// 大量超时用的分层时间轮（见 wheel.c）。每个核一个轮子，挂/摘都是 O(1)；
+// 精度是一个轮子刻度（WHEEL_TICK，1 毫秒），适合 I/O 超时、重试、sleep
+// 这类不需要亚毫秒精度、数量又多的定时器。要精确到 time 计数的用 timer.h。
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include "timer.h"
+
+#define WHEEL_TICK (TIMER_HZ / 1000)  // 一个刻度 = 1 毫秒
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)  // 每层 64 个槽
+#define WHEEL_LEVELS 4                // 最远 64^4 个刻度（约 4.6 小时）
+
+// 调用者自己分配（清零即可用）。回调在 softirq 下半部里、开着中断运行
+struct wtimer {
+  struct wtimer *next;                // 所在槽的双向链表
+  struct wtimer *prev;
+  uint64 expires;                     // 到期的刻度（向上取整）
+  void (*fn)(void *arg);
+  void *arg;
+  int hart;                           // 挂在哪个核的轮子上（核号 + 1），0 = 没挂
+  uint8 level;
+  uint8 slot;
+};
+
+struct wheel_stats {
+  uint64 armed;                       // wtimer_add 次数
+  uint64 cancelled;                   // 到期前被取消的
+  uint64 expired;                     // 到期执行了回调的
+  uint64 cascaded;                    // 从高层挪到低层的次数
+  uint64 runs;                        // 轮子被推进的次数
+  uint64 run_cycles;                  // 推进时花的周期数（含回调）
+  uint64 pending;                     // 现在挂着的
+};
+
+void wheelinithart(void);
+void wtimer_add(struct wtimer *t, uint64 deadline, void (*fn)(void *), void *arg);
+int wtimer_cancel(struct wtimer *t);
+void wheel_get_stats(struct wheel_stats *st);    // 所有核加起来
+void wheel_print_stats(void);
+
+#endif // WHEEL_H
@@ -0,0 +1,346 @@
+// zswap.c - compressed RAM tier for swapped-out pages
+//
+// Before a page goes to disk, swap_out() offers it here. The page is
+// compressed with a small LZ77 codec (LZ4-style sequences: a token with
+// literal and match lengths, the literals, a 16-bit back offset) and kept
+// if it shrinks to ZS_MAX_LEN bytes or less.
+//
+// The pool is made of kalloc() pages, capped at 1/ZS_POOL_DIV of memory.
+// Each pool page holds a fixed number of equal slots (16, 8, 5, 4, 3 or 2
+// per page), so an object never spans pages and a free slot is found
+// without searching. Objects are reference counted like disk slots, since
+// a COW fork shares a swap entry between two page tables.
+//
+// A handle is (pool page index << ZS_OBJ_BITS) | slot.
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+#include "kmem.h"
+#include "swap.h"
+#include <string.h>
+
+#define ZS_POOL_DIV 8           // pool may use 1/8 of memory (16 MiB of 128 MiB)
+#define ZS_TABLE 4096           // pool pages we can track
+#define ZS_MAX_LEN (PGSIZE / 2) // keep only pages compressed at least 2:1
+#define ZS_NCLASS 6
+#define ZS_OBJ_BITS 4
+#define ZS_MAX_OBJS (1 << ZS_OBJ_BITS)
+
+#define LZ_MINMATCH 4
+#define LZ_HASH_BITS 10
+#define LZ_MAX_OFFSET 0xffff
+
+static const uint8 class_objs[ZS_NCLASS] = { 16, 8, 5, 4, 3, 2 };
+
+struct zpage {
+    char *mem;                      // the pool page
+    struct zpage *next;             // partial list of the class
+    struct zpage *prev;
+    uint16 idx;                     // index in zs_pages[]
+    uint8 cls;
+    uint8 nused;
+    uint16 len[ZS_MAX_OBJS];        // compressed length per slot, 0 = free
+    uint8 refs[ZS_MAX_OBJS];
+};
+
+static struct spinlock zs_lock = { 0, "zswap" };
+static struct zpage *zs_pages[ZS_TABLE];
+static struct zpage *zs_partial[ZS_NCLASS];
+static size_t zs_hint = 0;          // next zs_pages[] index to try
+static size_t zs_max_pages = 0;
+static struct zswap_stats zs_st;
+
+// per-hart compression scratch: the output buffer and the match table.
+// stores come only from process context (reclaim), which never moves to
+// another hart, so busy is enough to keep the scratch to one user and the
+// compression itself runs with interrupts enabled.
+struct zs_pcp {
+    uint8 buf[ZS_MAX_LEN];
+    uint16 table[1 << LZ_HASH_BITS];
+    int busy;
+} __attribute__((aligned(64)));
+static struct zs_pcp zs_pcp[NCPU];
+
+static inline size_t class_size(int cls) {
+    return (PGSIZE / class_objs[cls]) & ~15UL;
+}
+
+// ---- codec ----
+
+static inline uint32 lz_read32(const uint8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24);
+}
+
+static inline uint32 lz_hash(uint32 v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// length beyond the 4-bit token field: 255-byte continuation bytes.
+static int lz_put_len(uint8 *out, int op, int cap, int len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= cap) return -1;
+        out[op++] = 255;
+    }
+    if (op >= cap) return -1;
+    out[op++] = len;
+    return op;
+}
+
+// one sequence: lit literals from src, then (if mlen) a match of mlen
+// bytes off bytes back. returns the new output position or -1 if full.
+static int lz_put_seq(uint8 *out, int op, int cap, const uint8 *src, int lit,
+                      int off, int mlen) {
+    if (op >= cap) return -1;
+    int ml = mlen ? mlen - LZ_MINMATCH : 0;
+    int t = op++;
+    out[t] = (lit < 15 ? lit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (lit >= 15 && (op = lz_put_len(out, op, cap, lit - 15)) < 0) return -1;
+    if (op + lit > cap) return -1;
+    memcpy(out + op, src, lit);
+    op += lit;
+    if (!mlen) return op;
+    if (op + 2 > cap) return -1;
+    out[op++] = off & 0xff;
+    out[op++] = off >> 8;
+    if (ml >= 15 && (op = lz_put_len(out, op, cap, ml - 15)) < 0) return -1;
+    return op;
+}
+
+// compress n bytes into at most cap bytes; returns the length, or 0 if
+// it does not fit.
+static int lz_compress(const uint8 *in, int n, uint8 *out, int cap, uint16 *table) {
+    memset(table, 0, sizeof(uint16) << LZ_HASH_BITS);
+    int ip = 0, anchor = 0, op = 0;
+    while (ip + LZ_MINMATCH <= n) {
+        uint32 v = lz_read32(in + ip);
+        uint32 h = lz_hash(v);
+        int ref = (int)table[h] - 1;    // positions are stored + 1; 0 = empty
+        table[h] = ip + 1;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(in + ref) != v) {
+            ip++;
+            continue;
+        }
+        int len = LZ_MINMATCH;
+        while (ip + len < n && in[ref + len] == in[ip + len])
+            len++;
+        op = lz_put_seq(out, op, cap, in + anchor, ip - anchor, ip - ref, len);
+        if (op < 0) return 0;
+        ip += len;
+        anchor = ip;
+    }
+    // the last sequence is literals only; the decoder stops at its end
+    op = lz_put_seq(out, op, cap, in + anchor, n - anchor, 0, 0);
+    return op < 0 ? 0 : op;
+}
+
+static int lz_get_len(const uint8 *in, int *ip, int n, int len) {
+    if (len < 15) return len;
+    for (;;) {
+        if (*ip >= n) return -1;
+        uint8 b = in[(*ip)++];
+        len += b;
+        if (b != 255) return len;
+    }
+}
+
+// decompress n bytes of in into exactly outlen bytes. 0 on success.
+static int lz_decompress(const uint8 *in, int n, uint8 *out, int outlen) {
+    int ip = 0, op = 0;
+    while (ip < n) {
+        uint8 t = in[ip++];
+        int lit = lz_get_len(in, &ip, n, t >> 4);
+        if (lit < 0 || ip + lit > n || op + lit > outlen) return -1;
+        memcpy(out + op, in + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n) break;
+        if (ip + 2 > n) return -1;
+        int off = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int len = lz_get_len(in, &ip, n, t & 15);
+        if (len < 0 || off == 0 || off > op) return -1;
+        len += LZ_MINMATCH;
+        if (op + len > outlen) return -1;
+        // byte at a time: the match may overlap its own output
+        for (int i = 0; i < len; i++, op++)
+            out[op] = out[op - off];
+    }
+    return op == outlen ? 0 : -1;
+}
+
+// ---- pool ----
+
+void zswap_init(void) {
+    zs_max_pages = kmem_total_pages() / ZS_POOL_DIV;
+    if (zs_max_pages > ZS_TABLE) zs_max_pages = ZS_TABLE;
+    zs_st.max_pages = zs_max_pages;
+    printf("zswap: pool up to %llu KiB\n",
+           (unsigned long long)(zs_max_pages * PGSIZE / 1024));
+}
+
+int zswap_full(void) {
+    return __atomic_load_n(&zs_st.pool_pages, __ATOMIC_RELAXED) >= zs_max_pages;
+}
+
+static int len_to_class(int len) {
+    for (int cls = ZS_NCLASS - 1; cls >= 0; cls--)
+        if ((size_t)len <= class_size(cls)) return cls;
+    return -1;
+}
+
+static void list_push(struct zpage **head, struct zpage *z) {
+    z->prev = NULL;
+    z->next = *head;
+    if (*head) (*head)->prev = z;
+    *head = z;
+}
+
+static void list_remove(struct zpage **head, struct zpage *z) {
+    if (z->prev) z->prev->next = z->next;
+    else *head = z->next;
+    if (z->next) z->next->prev = z->prev;
+    z->next = z->prev = NULL;
+}
+
+// a fresh pool page for cls, on the partial list. zs_lock held; the
+// page allocations happen with it held, which kalloc() allows.
+static struct zpage *zpage_new(int cls) {
+    if (zs_st.pool_pages >= zs_max_pages) return NULL;
+    size_t i;
+    for (i = 0; i < ZS_TABLE; i++)
+        if (!zs_pages[(zs_hint + i) % ZS_TABLE]) break;
+    if (i == ZS_TABLE) return NULL;
+    size_t idx = (zs_hint + i) % ZS_TABLE;
+    struct zpage *z = kzalloc(sizeof(*z));
+    if (!z) return NULL;
+    z->mem = kalloc_nozero();
+    if (!z->mem) {
+        kfree_obj(z);
+        return NULL;
+    }
+    z->idx = idx;
+    z->cls = cls;
+    zs_pages[idx] = z;
+    zs_hint = idx + 1;
+    zs_st.pool_pages++;
+    list_push(&zs_partial[cls], z);
+    return z;
+}
+
+static struct zpage *handle_page(long h, int *obj) {
+    size_t idx = (size_t)h >> ZS_OBJ_BITS;
+    *obj = h & (ZS_MAX_OBJS - 1);
+    struct zpage *z = idx < ZS_TABLE ? zs_pages[idx] : NULL;
+    if (!z || *obj >= class_objs[z->cls] || z->len[*obj] == 0)
+        panic("zswap: bad handle");
+    return z;
+}
+
+long zswap_store(const void *page) {
+    struct zs_pcp *p = &zs_pcp[cpuid()];
+    int len = 0;
+    // re-entered on this hart (not expected): treat as incompressible
+    int mine = !__atomic_exchange_n(&p->busy, 1, __ATOMIC_ACQUIRE);
+    if (mine)
+        len = lz_compress(page, PGSIZE, p->buf, ZS_MAX_LEN, p->table);
+    long h = -1;
+    acquire(&zs_lock);
+    int cls = len ? len_to_class(len) : -1;
+    if (cls < 0) {
+        zs_st.rejects++;
+    } else {
+        struct zpage *z = zs_partial[cls];
+        if (!z && !(z = zpage_new(cls))) {
+            zs_st.full++;
+        } else {
+            int obj = 0;
+            while (z->len[obj]) obj++;
+            memcpy(z->mem + obj * class_size(cls), p->buf, len);
+            z->len[obj] = len;
+            z->refs[obj] = 1;
+            if (++z->nused == class_objs[cls])
+                list_remove(&zs_partial[cls], z);   // full pages live on no list
+            zs_st.stores++;
+            zs_st.objects++;
+            zs_st.bytes += len;
+            h = ((long)z->idx << ZS_OBJ_BITS) | obj;
+        }
+    }
+    release(&zs_lock);
+    if (mine)
+        __atomic_store_n(&p->busy, 0, __ATOMIC_RELEASE);
+    return h;
+}
+
+int zswap_load(long h, void *page) {
+    int obj;
+    acquire(&zs_lock);
+    struct zpage *z = handle_page(h, &obj);
+    const uint8 *src = (uint8 *)z->mem + obj * class_size(z->cls);
+    int len = z->len[obj];
+    zs_st.loads++;
+    release(&zs_lock);
+    // our reference keeps the object in place; decompress unlocked
+    return lz_decompress(src, len, page, PGSIZE);
+}
+
+void zswap_dup(long h) {
+    int obj;
+    acquire(&zs_lock);
+    struct zpage *z = handle_page(h, &obj);
+    if (z->refs[obj] == 0xff)
+        panic("zswap_dup: too many references");
+    z->refs[obj]++;
+    release(&zs_lock);
+}
+
+void zswap_free(long h) {
+    int obj;
+    struct zpage *victim = NULL;
+    acquire(&zs_lock);
+    struct zpage *z = handle_page(h, &obj);
+    if (--z->refs[obj] == 0) {
+        int cls = z->cls;
+        zs_st.objects--;
+        zs_st.bytes -= z->len[obj];
+        z->len[obj] = 0;
+        if (z->nused-- == class_objs[cls])
+            list_push(&zs_partial[cls], z);
+        if (z->nused == 0) {
+            // empty pages go straight back: the pool only holds live data
+            list_remove(&zs_partial[cls], z);
+            zs_pages[z->idx] = NULL;
+            zs_st.pool_pages--;
+            victim = z;
+        }
+    }
+    release(&zs_lock);
+    if (victim) {
+        kfree(victim->mem);
+        kfree_obj(victim);
+    }
+}
+
+void zswap_get_stats(struct zswap_stats *st) {
+    acquire(&zs_lock);
+    *st = zs_st;
+    release(&zs_lock);
+}
+
+void zswap_print_stats(void) {
+    struct zswap_stats st;
+    zswap_get_stats(&st);
+    uint64_t raw = st.objects * PGSIZE;
+    // ratio x100: raw / compressed bytes, and raw / pool memory
+    // (the second includes slot rounding and partly filled pages)
+    printf("zswap: %llu pages in %llu/%llu pool pages, %llu stores %llu loads\n",
+           (unsigned long long)st.objects, (unsigned long long)st.pool_pages,
+           (unsigned long long)st.max_pages, (unsigned long long)st.stores,
+           (unsigned long long)st.loads);
+    printf("zswap: ratio %llu%% codec, %llu%% pool; %llu incompressible, %llu pool full\n",
+           (unsigned long long)(st.bytes ? raw * 100 / st.bytes : 0),
+           (unsigned long long)(st.pool_pages ? raw * 100 / (st.pool_pages * PGSIZE) : 0),
+           (unsigned long long)st.rejects, (unsigned long long)st.full);
+}